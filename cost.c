@@ -0,0 +1,564 @@
+/**
+ * \file cost.c
+ * \brief Estimate how long a video takes to decode on the device
+ *
+ * This runs on the host. It decodes every frame with the decoder, counting
+ * what it does with `DECODER_STATS`, and weighs the counters to estimate how
+ * many lines of the display the device spends on each frame. Nothing is
+ * written out. The counters need every vector walked, so the frames are still
+ * decoded, just on the host.
+ *
+ * The weights are in instructions. The defaults are rough counts of what the
+ * decoder's loops do for each thing they count. To get real numbers, build the
+ * player with `DECODER_STATS` and `VIDEO_DEMO_BENCHMARK`, run it on the device,
+ * save what it prints, and pass that to `-c`. It prints the counters and time
+ * for every frame, and the weights are fit to those by least squares. They're
+ * printed so they can be given with `-w` next time.
+ *
+ * Frames are checked against the time they have, which is the frame period.
+ * The player can decode ahead, so one slow frame isn't a problem by itself. So,
+ * every second of video is checked too, and the program fails if any of them
+ * needs more time than a second has.
+ *
+ * Its positional argument is the input file in raw CVID format, or in the
+ * native format if `DECODER_NATIVE` is defined. The options are:
+ * * `-p N`: Each frame is shown for `N` vblanks instead of `4`
+ * * `-l N`: The device runs `N` instructions per line instead of `1000`
+ * * `-c FILE`: Fit the weights to the statistics the player printed in `FILE`
+ * * `-w NAME=N`: Set the weight called `NAME` to `N` instructions, and don't
+ *   fit it with `-c`
+ * * `-s N`: Report the `N` most expensive frames instead of `5`
+ * * `-v`: Report every frame
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "decoder.h"
+
+#ifndef DECODER_STATS
+#error "The cost estimate is built on the decoder's statistics"
+#endif
+
+/**
+ * \brief How many lines the display counts through per refresh
+ * \see VIDEO_DEMO_REFRESH_LINES
+ */
+#define REFRESH_LINES 308
+
+/**
+ * \brief How many vblanks are in a second
+ */
+#define REFRESH_RATE 60
+
+/**
+ * \brief Print an error message, then exit
+ * \param[in] msg The message to print to STDERR
+ */
+__attribute__((noreturn)) void die(const char *msg) {
+  fprintf(stderr, "Error: %s\n", msg);
+  exit(1);
+}
+
+/**
+ * \brief Global decoder for cinepak
+ */
+decoder_t decoder;
+
+/**
+ * \defgroup WEIGHTS
+ * \brief How many instructions each counter costs
+ * @{
+ */
+
+/**
+ * \brief The weight of every counter, in instructions
+ *
+ * Every frame also pays for its headers, its strips, and the player's work
+ * between strips. That's all in the weight for frames.
+ *
+ * The defaults haven't been fit to the device. They're rough counts of what
+ * the decoder's loops do for each thing they count.
+ */
+typedef struct weights_t {
+  double frame;
+  double byte;
+  double entry;
+  double v1;
+  double v4;
+  double skipped;
+} weights_t;
+
+weights_t weights = {
+    .frame = 1500.0,
+    .byte = 0.0,
+    .entry = 130.0,
+    .v1 = 30.0,
+    .v4 = 50.0,
+    .skipped = 2.0,
+};
+
+/**
+ * \brief Names for the weights, for `-w` and for printing them
+ *
+ * Each weight also has the counter it's for, and whether it was given with
+ * `-w`.
+ */
+struct {
+  const char *name;
+  double *weight;
+  size_t counter;
+  bool given;
+} weight_names[] = {
+    {"frame", &weights.frame, offsetof(decoder_stats_t, frames), false},
+    {"byte", &weights.byte, offsetof(decoder_stats_t, bytes), false},
+    {"entry", &weights.entry, offsetof(decoder_stats_t, codebook_entries),
+     false},
+    {"v1", &weights.v1, offsetof(decoder_stats_t, v1_blocks), false},
+    {"v4", &weights.v4, offsetof(decoder_stats_t, v4_blocks), false},
+    {"skipped", &weights.skipped, offsetof(decoder_stats_t, skipped_blocks),
+     false},
+};
+
+#define WEIGHT_NAMES (sizeof(weight_names) / sizeof(weight_names[0]))
+
+/**
+ * \brief Get the counter a weight is for
+ * \param[in] stats The counters for a frame
+ * \param[in] i Which entry of `weight_names` the weight is
+ */
+double weight_counter(const decoder_stats_t *stats, size_t i) {
+  uint32_t value;
+  memcpy(&value, (const char *)stats + weight_names[i].counter, sizeof(value));
+  return value;
+}
+
+/**
+ * \brief Set a weight from an argument to `-w`
+ *
+ * If the argument is malformed, this method calls die() and exits.
+ *
+ * \param[in] arg The argument, as `NAME=N`
+ */
+void set_weight(const char *arg) {
+  const char *value = strchr(arg, '=');
+  if (value == NULL)
+    die("weight must be given as NAME=N");
+  for (size_t i = 0; i < WEIGHT_NAMES; i++) {
+    const char *name = weight_names[i].name;
+    if (strlen(name) == (size_t)(value - arg) &&
+        strncmp(arg, name, value - arg) == 0) {
+      char *end;
+      *weight_names[i].weight = strtod(value + 1, &end);
+      if (*end != '\0' || end == value + 1)
+        die("weight must be a number");
+      weight_names[i].given = true;
+      return;
+    }
+  }
+  die("no weight has that name");
+}
+
+/**
+ * \brief Print the weights in the same form `-w` takes them
+ */
+void print_weights(void) {
+  printf("Weights:");
+  for (size_t i = 0; i < WEIGHT_NAMES; i++)
+    printf(" -w %s=%.1f", weight_names[i].name, *weight_names[i].weight);
+  printf("\n");
+}
+
+/**
+ * \brief Solve for the weights that aren't held, by least squares
+ *
+ * The system is scaled by its diagonal first, so the counters' very different
+ * sizes don't matter when deciding whether it can be solved. The held weights
+ * are taken as they are.
+ *
+ * A counter can be a mix of the ones before it. For instance, every block is
+ * V1, V4, or skipped, so those add up to the same number for every frame that
+ * covers the whole screen, just like the counter for frames does. Then, there's
+ * no telling the weights apart, and the later weight is returned so it can be
+ * held.
+ *
+ * \param[in] products The sums of products of every pair of counters
+ * \param[in] targets The sums of each counter times the instructions measured
+ * \param[in] held Which weights to leave alone
+ * \param[out] fitted Where to write the weights that aren't held
+ * \return `WEIGHT_NAMES` if it was solved, or the weight that couldn't be
+ */
+size_t solve_weights(const double products[WEIGHT_NAMES][WEIGHT_NAMES],
+                     const double targets[WEIGHT_NAMES],
+                     const bool held[WEIGHT_NAMES],
+                     double fitted[WEIGHT_NAMES]) {
+  // Pull out the weights we're solving for, along with what's left of the
+  // targets once the held weights are accounted for
+  size_t unheld[WEIGHT_NAMES];
+  size_t n = 0;
+  for (size_t i = 0; i < WEIGHT_NAMES; i++) {
+    if (!held[i])
+      unheld[n++] = i;
+  }
+  double scales[WEIGHT_NAMES];
+  for (size_t r = 0; r < n; r++)
+    scales[r] = sqrt(products[unheld[r]][unheld[r]]);
+  double a[WEIGHT_NAMES][WEIGHT_NAMES + 1];
+  for (size_t r = 0; r < n; r++) {
+    const size_t i = unheld[r];
+    double target = targets[i];
+    for (size_t j = 0; j < WEIGHT_NAMES; j++) {
+      if (held[j])
+        target -= products[i][j] * *weight_names[j].weight;
+    }
+    for (size_t c = 0; c < n; c++)
+      a[r][c] = products[i][unheld[c]] / (scales[r] * scales[c]);
+    a[r][n] = target / scales[r];
+  }
+
+  // Gaussian elimination, with partial pivoting. If nothing is left in a
+  // column, its counter is a mix of the ones before it.
+  for (size_t c = 0; c < n; c++) {
+    size_t pivot = c;
+    for (size_t r = c + 1; r < n; r++) {
+      if (fabs(a[r][c]) > fabs(a[pivot][c]))
+        pivot = r;
+    }
+    if (fabs(a[pivot][c]) < 1e-9)
+      return unheld[c];
+    for (size_t k = 0; k <= n; k++) {
+      const double t = a[c][k];
+      a[c][k] = a[pivot][k];
+      a[pivot][k] = t;
+    }
+    for (size_t r = 0; r < n; r++) {
+      if (r == c)
+        continue;
+      const double f = a[r][c] / a[c][c];
+      for (size_t k = c; k <= n; k++)
+        a[r][k] -= f * a[c][k];
+    }
+  }
+  for (size_t r = 0; r < n; r++)
+    fitted[unheld[r]] = a[r][n] / a[r][r] / scales[r];
+  return WEIGHT_NAMES;
+}
+
+/**
+ * \brief Fit the weights to what the player measured on the device
+ *
+ * Built with `DECODER_STATS` and `VIDEO_DEMO_BENCHMARK`, the player prints a
+ * line for every frame with its counters and how many lines it took. The
+ * weights are fit to all of them at once, by least squares. Lines that aren't
+ * for frames are ignored, so the whole output can be given.
+ *
+ * Some weights aren't fit, and keep the value they had. Those are the ones
+ * given with `-w`, ones for counters that were zero for every frame, and ones
+ * that can't be told apart from the others. If a weight would come out
+ * negative, it's set to zero instead. Either way, the rest are fit again, and
+ * what wasn't fit is reported.
+ *
+ * If an error occurs, this method calls die() and exits.
+ *
+ * \param[in] path The file the player's output was saved to
+ * \param[in] line_instructions How many instructions the device runs per line
+ */
+void calibrate(const char *path, double line_instructions) {
+  FILE *handle = fopen(path, "r");
+  if (handle == NULL)
+    die("failed to open statistics file");
+
+  // Sum up what least squares needs from every frame
+  double products[WEIGHT_NAMES][WEIGHT_NAMES] = {{0.0}};
+  double targets[WEIGHT_NAMES] = {0.0};
+  double squares = 0.0;
+  size_t frames = 0;
+  bool timed = false;
+  char line[256];
+  while (fgets(line, sizeof(line), handle) != NULL) {
+    decoder_stats_t stats = {.frames = 1};
+    unsigned int frame, bytes, entries, v1, v4, skipped, lines;
+    if (sscanf(line,
+               "Frame %u: %u bytes, %u entries, %u V1, %u V4, %u skipped, "
+               "%u lines",
+               &frame, &bytes, &entries, &v1, &v4, &skipped, &lines) != 7)
+      continue;
+    stats.bytes = bytes;
+    stats.codebook_entries = entries;
+    stats.v1_blocks = v1;
+    stats.v4_blocks = v4;
+    stats.skipped_blocks = skipped;
+    const double instructions = lines * line_instructions;
+    for (size_t i = 0; i < WEIGHT_NAMES; i++) {
+      const double counter = weight_counter(&stats, i);
+      for (size_t j = 0; j < WEIGHT_NAMES; j++)
+        products[i][j] += counter * weight_counter(&stats, j);
+      targets[i] += counter * instructions;
+    }
+    squares += instructions * instructions;
+    frames++;
+    timed = timed || lines != 0;
+  }
+  fclose(handle);
+  if (frames == 0 || !timed)
+    die("statistics file doesn't have timed frames from a benchmark build");
+
+  // Fit, holding whatever we can't or shouldn't. Every pass holds one more
+  // weight, so this finishes.
+  const char *unfit[WEIGHT_NAMES];
+  for (size_t i = 0; i < WEIGHT_NAMES; i++) {
+    unfit[i] = weight_names[i].given   ? "was given"
+               : products[i][i] == 0.0 ? "had nothing to count"
+                                       : NULL;
+  }
+  for (;;) {
+    bool held[WEIGHT_NAMES];
+    for (size_t i = 0; i < WEIGHT_NAMES; i++)
+      held[i] = unfit[i] != NULL;
+    double fitted[WEIGHT_NAMES];
+    size_t dependent = solve_weights(products, targets, held, fitted);
+    if (dependent != WEIGHT_NAMES) {
+      unfit[dependent] = "can't be told apart from the others";
+      continue;
+    }
+    size_t negative = WEIGHT_NAMES;
+    for (size_t i = 0; i < WEIGHT_NAMES; i++) {
+      if (!held[i] && fitted[i] < 0.0 &&
+          (negative == WEIGHT_NAMES || fitted[i] < fitted[negative]))
+        negative = i;
+    }
+    if (negative != WEIGHT_NAMES) {
+      *weight_names[negative].weight = 0.0;
+      unfit[negative] = "came out negative, so it's zero";
+      continue;
+    }
+    for (size_t i = 0; i < WEIGHT_NAMES; i++) {
+      if (!held[i])
+        *weight_names[i].weight = fitted[i];
+    }
+    break;
+  }
+
+  // Say how well it fits. The squared error comes out of the same sums.
+  double error = squares;
+  for (size_t i = 0; i < WEIGHT_NAMES; i++) {
+    const double wi = *weight_names[i].weight;
+    error -= 2.0 * wi * targets[i];
+    for (size_t j = 0; j < WEIGHT_NAMES; j++)
+      error += wi * products[i][j] * *weight_names[j].weight;
+  }
+  printf("Fit to %zu frames, off by %.1f lines per frame (root mean square)\n",
+         frames, sqrt(error > 0.0 ? error / frames : 0.0) / line_instructions);
+  for (size_t i = 0; i < WEIGHT_NAMES; i++) {
+    if (unfit[i] != NULL)
+      printf("Didn't fit %s, since it %s\n", weight_names[i].name, unfit[i]);
+  }
+}
+
+/** @} */
+
+/**
+ * \brief What we keep about each frame
+ */
+typedef struct frame_cost_t {
+  bool keyframe;
+  uint16_t strips;
+  decoder_stats_t stats;
+  double lines;
+} frame_cost_t;
+
+/**
+ * \brief Estimate how many lines a frame takes to decode
+ * \param[in] stats The frame's counters from the decoder
+ * \param[in] line_instructions How many instructions the device runs per line
+ */
+double estimate_lines(const decoder_stats_t *stats, double line_instructions) {
+  double instructions = 0.0;
+  for (size_t i = 0; i < WEIGHT_NAMES; i++)
+    instructions += *weight_names[i].weight * weight_counter(stats, i);
+  return instructions / line_instructions;
+}
+
+/**
+ * \brief Print everything we know about a frame
+ * \param[in] i The frame's index
+ * \param[in] frame What we kept about it
+ * \param[in] budget How many lines it has
+ */
+void print_frame(size_t i, const frame_cost_t *frame, double budget) {
+  printf("Frame %zu%s: %u strips, %u bytes, %u entries, %u V1, %u V4, %u "
+         "skipped, %.0f lines (%.0f%% of its time)\n",
+         i, frame->keyframe ? " (keyframe)" : "", frame->strips,
+         (unsigned int)frame->stats.bytes,
+         (unsigned int)frame->stats.codebook_entries,
+         (unsigned int)frame->stats.v1_blocks,
+         (unsigned int)frame->stats.v4_blocks,
+         (unsigned int)frame->stats.skipped_blocks, frame->lines,
+         100.0 * frame->lines / budget);
+}
+
+int main(int argc, char **argv) {
+
+  // Parse options
+  size_t period = 4;
+  double line_instructions = 1000.0;
+  const char *calibration = NULL;
+  size_t worst = 5;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:l:c:w:s:v")) != -1) {
+    switch (opt) {
+    case 'p':
+      period = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      line_instructions = strtod(optarg, NULL);
+      break;
+    case 'c':
+      calibration = optarg;
+      break;
+    case 'w':
+      set_weight(optarg);
+      break;
+    case 's':
+      worst = strtoul(optarg, NULL, 10);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      die("usage: video-demo-cost [-p period] [-l instructions] [-c stats] "
+          "[-w name=weight] [-s worst] [-v] video");
+    }
+  }
+  if (optind != argc - 1)
+    die("need exactly one video");
+  if (period == 0 || line_instructions <= 0.0)
+    die("period and instructions per line must be positive");
+  if (calibration != NULL)
+    calibrate(calibration, line_instructions);
+
+  // Read in the video
+  void *video;
+  size_t video_length;
+  {
+    FILE *video_handle = fopen(argv[optind], "r");
+    if (video_handle == NULL)
+      die("failed to open video file");
+    if (fseek(video_handle, 0l, SEEK_END) != 0)
+      die("failed to seek in video file");
+    video_length = ftell(video_handle);
+    if (fseek(video_handle, 0l, SEEK_SET) != 0)
+      die("failed to seek in video file");
+    video = malloc(video_length);
+    if (video == NULL)
+      die("failed to allocate video buffer");
+    if (fread(video, 1, video_length, video_handle) != video_length)
+      die("failed to read video file");
+    fclose(video_handle);
+  }
+
+  // Decode every frame, keeping its counters. Every frame has a header, so that
+  // bounds how many there can be.
+  frame_cost_t *frames =
+      malloc(sizeof(frame_cost_t) * (video_length / DECODER_FRAME_HEADER + 1));
+  if (frames == NULL)
+    die("failed to allocate frame buffer");
+  size_t frames_length = 0;
+  decoder_initialize(&decoder, video, video_length);
+  while (decoder_has_next_frame(&decoder)) {
+    decoder_frame_info_t info;
+    if (decoder_peek_frame(&decoder, &info) != SUCCESS ||
+        decoder_compute_frame(&decoder) != SUCCESS) {
+      fprintf(stderr, "Error: got error decoding frame %zu\n", frames_length);
+      exit(1);
+    }
+    frame_cost_t *frame = frames + frames_length++;
+    frame->keyframe = info.keyframe;
+    frame->strips = info.strips;
+    frame->stats = *decoder_get_frame_stats(&decoder);
+    frame->lines = estimate_lines(&frame->stats, line_instructions);
+  }
+  if (frames_length == 0)
+    die("video has no frames");
+
+  // Each frame has until the next one is due. A second of video has as many
+  // frames as are shown in a second, and it has the time they're shown for.
+  const double frame_budget = (double)period * REFRESH_LINES;
+  size_t window = REFRESH_RATE / period;
+  if (window == 0)
+    window = 1;
+  if (window > frames_length)
+    window = frames_length;
+  const double window_budget = window * frame_budget;
+
+  // Report every frame if asked, and add them up
+  double total = 0.0;
+  size_t over = 0;
+  for (size_t i = 0; i < frames_length; i++) {
+    if (verbose)
+      print_frame(i, frames + i, frame_budget);
+    total += frames[i].lines;
+    if (frames[i].lines > frame_budget)
+      over++;
+  }
+
+  // Find the worst second
+  double window_lines = 0.0;
+  for (size_t i = 0; i < window; i++)
+    window_lines += frames[i].lines;
+  double worst_window_lines = window_lines;
+  size_t worst_window = 0;
+  for (size_t i = window; i < frames_length; i++) {
+    window_lines += frames[i].lines - frames[i - window].lines;
+    if (window_lines > worst_window_lines) {
+      worst_window_lines = window_lines;
+      worst_window = i + 1 - window;
+    }
+  }
+
+  // Summarize
+  print_weights();
+  printf("Estimated %.0f lines for %zu frames, %.0f lines per frame on "
+         "average\n",
+         total, frames_length, total / frames_length);
+  printf("Each frame has %.0f lines, and %zu frames go over\n", frame_budget,
+         over);
+  printf("Worst second is frames %zu to %zu, with %.0f lines (%.0f%% of its "
+         "time)\n",
+         worst_window, worst_window + window - 1, worst_window_lines,
+         100.0 * worst_window_lines / window_budget);
+
+  // Rank the most expensive frames. There aren't many, so just pick them out
+  // one at a time.
+  if (worst > frames_length)
+    worst = frames_length;
+  bool *reported = calloc(frames_length, sizeof(bool));
+  if (reported == NULL)
+    die("failed to allocate frame buffer");
+  printf("Most expensive frames:\n");
+  for (size_t rank = 0; rank < worst; rank++) {
+    size_t slowest = 0;
+    for (size_t i = 1; i < frames_length; i++) {
+      if (!reported[i] && (reported[slowest] ||
+                           frames[i].lines > frames[slowest].lines))
+        slowest = i;
+    }
+    reported[slowest] = true;
+    print_frame(slowest, frames + slowest, frame_budget);
+  }
+
+  // Done
+  free(reported);
+  free(frames);
+  free(video);
+  if (worst_window_lines > window_budget) {
+    fprintf(stderr, "Error: video needs more time than it has\n");
+    return 1;
+  }
+  return 0;
+}
@@ -5,6 +5,171 @@
 void *memset(void *s, int c, size_t n);
 void *memcpy(void *restrict dest, const void *restrict src, size_t n);
 
+/**
+ * \brief Get the width of the frame being decoded
+ * \see decoder_get_dimensions()
+ */
+static inline size_t decoder_width(const decoder_t *decoder) {
+#ifdef DECODER_ANY_SIZE
+  return decoder->width;
+#else
+  (void)decoder;
+  return DECODER_WIDTH;
+#endif
+}
+
+/**
+ * \brief Get the height of the frame being decoded
+ * \see decoder_get_dimensions()
+ */
+static inline size_t decoder_height(const decoder_t *decoder) {
+#ifdef DECODER_ANY_SIZE
+  return decoder->height;
+#else
+  (void)decoder;
+  return DECODER_HEIGHT;
+#endif
+}
+
+/**
+ * \defgroup DECODER_CLEARING
+ * \brief Clear the decoder's own framebuffer as late as possible
+ *
+ * The framebuffer has to start out black, but clearing all of it up front is
+ * usually wasted work, since the first frame is normally a keyframe that covers
+ * the whole screen. Instead, each row of blocks is cleared just before the
+ * first strip that might not overwrite all of it. Rows that an intra-coded
+ * strip covers the whole width of are never cleared, and rows no strip touched
+ * are cleared once the frame is done.
+ *
+ * This stops after the first frame, or when the decoder is told to write its
+ * frames somewhere else. With `DECODER_ARENA`, there's no framebuffer to clear,
+ * so these do nothing.
+ *
+ * @{
+ */
+
+/**
+ * \brief Get the rows a strip covers ready to decode the strip into
+ * \param[inout] decoder Decoder with rows that might not be cleared yet
+ * \param[in] strip The strip about to be decoded, with its coordinates
+ * \param[in] intra Whether every block in the strip will be written
+ */
+static void decoder_clear_strip(decoder_t *decoder,
+                                const decoder_strip_t *strip, bool intra) {
+#ifndef DECODER_ARENA
+  if (!decoder->clear_pending)
+    return;
+  const bool overwritten =
+      intra && strip->x0 == 0 && strip->x1 == DECODER_WIDTH;
+  for (uint16_t y = strip->y0; y < strip->y1; y += 4) {
+    if (!decoder->uncleared[y / 4])
+      continue;
+    decoder->uncleared[y / 4] = false;
+    if (!overwritten)
+      memset(decoder->framebuffer + DECODER_SCALE * y * DECODER_OUTPUT_WIDTH,
+             0, sizeof(uint16_t) * DECODER_BLOCK_LINES * DECODER_OUTPUT_WIDTH);
+  }
+#else
+  (void)decoder;
+  (void)strip;
+  (void)intra;
+#endif
+}
+
+/**
+ * \brief Clear every row that still needs it
+ * \param[inout] decoder Decoder with rows that might not be cleared yet
+ */
+static void decoder_clear_rest(decoder_t *decoder) {
+#ifndef DECODER_ARENA
+  if (!decoder->clear_pending)
+    return;
+  for (size_t row = 0; row < DECODER_BLOCK_ROWS; row++) {
+    if (decoder->uncleared[row])
+      memset(decoder->framebuffer +
+                 DECODER_BLOCK_LINES * row * DECODER_OUTPUT_WIDTH,
+             0, sizeof(uint16_t) * DECODER_BLOCK_LINES * DECODER_OUTPUT_WIDTH);
+  }
+  decoder->clear_pending = false;
+#else
+  (void)decoder;
+#endif
+}
+
+/** @} */
+
+/**
+ * \brief Clear out all the strips, and have them share empty codebooks
+ *
+ * Only the first codebook of each kind is cleared, since the rest aren't used
+ * until a strip claims one.
+ *
+ * \param[inout] decoder The decoder, with its codebook storage set up
+ */
+static void decoder_reset_strips(decoder_t *decoder) {
+  memset(decoder->strips, 0, sizeof(decoder->strips));
+  memset(decoder->v4_refs, 0, sizeof(decoder->v4_refs));
+  memset(decoder->v1_refs, 0, sizeof(decoder->v1_refs));
+  if (decoder->max_strips == 0)
+    return;
+
+  memset(decoder->v4_books[0], 0, sizeof(decoder->v4_books[0]));
+  memset(decoder->v1_books[0], 0, sizeof(decoder->v1_books[0]));
+  decoder->v4_refs[0] = decoder->max_strips;
+  decoder->v1_refs[0] = decoder->max_strips;
+  for (size_t i = 0; i < decoder->max_strips; i++) {
+    decoder->strips[i].v4 = decoder->v4_books[0];
+    decoder->strips[i].v1 = decoder->v1_books[0];
+  }
+}
+
+/**
+ * \brief Reset everything in a decoder except where its data comes from
+ * \param[inout] decoder The decoder to reset
+ */
+static void decoder_reset(decoder_t *decoder) {
+
+#ifndef DECODER_ARENA
+  // Use our own storage, and decode into our own framebuffer until told
+  // otherwise
+  decoder->max_strips = DECODER_MAX_STRIPS;
+  decoder->v4_books = decoder->v4_storage;
+  decoder->v1_books = decoder->v1_storage;
+  decoder->output = decoder->framebuffer;
+  // It's cleared as the first frame is decoded, since that frame usually
+  // overwrites all of it
+  decoder->clear_pending = true;
+  memset(decoder->uncleared, true, sizeof(decoder->uncleared));
+#else
+  // We have nowhere to put codebooks or frames until we're given somewhere
+  decoder->max_strips = 0;
+  decoder->v4_books = NULL;
+  decoder->v1_books = NULL;
+  decoder->output = NULL;
+#endif
+  decoder_reset_strips(decoder);
+
+  // Nothing has been decoded yet
+  memset(decoder->dirty, 0, sizeof(decoder->dirty));
+#ifdef DECODER_ANY_SIZE
+  decoder->width = DECODER_WIDTH;
+  decoder->height = DECODER_HEIGHT;
+#endif
+
+  // No one is listening for strips yet
+  decoder->strip_callback = NULL;
+  decoder->strip_callback_context = NULL;
+
+#ifdef DECODER_STATS
+  // Nothing has been counted, and we have no way to tell time
+  memset(&decoder->stats_frame, 0, sizeof(decoder->stats_frame));
+  memset(&decoder->stats_total, 0, sizeof(decoder->stats_total));
+  decoder->stats_clock = NULL;
+  decoder->stats_clock_context = NULL;
+#endif
+}
+
 void decoder_initialize(decoder_t *decoder, const void *data, size_t length) {
 
   // Initialize the data
@@ -13,14 +178,114 @@ void decoder_initialize(decoder_t *decoder, const void *data, size_t length) {
 
   // We start at the start of the data
   decoder->data_index = 0;
+  decoder->data_offset = 0;
 
-  // Clear out all the strips, as well as the framebuffer
-  memset(decoder->strips, 0, sizeof(decoder->strips));
-  memset(decoder->framebuffer, 0, sizeof(decoder->framebuffer));
+  // It's all in memory, so there's nothing to read
+  decoder->read = NULL;
+  decoder->read_context = NULL;
+  decoder->staging = NULL;
+  decoder->staging_length = 0;
+
+  decoder_reset(decoder);
+}
+
+void decoder_set_strip_callback(decoder_t *decoder,
+                                void (*callback)(void *context,
+                                                 const decoder_strip_t *strip),
+                                void *context) {
+  decoder->strip_callback = callback;
+  decoder->strip_callback_context = context;
+}
+
+void decoder_set_arena(decoder_t *decoder, void *arena, size_t strips) {
+  // All the V4 codebooks come first, then all the V1 codebooks
+  decoder->max_strips = strips;
+  decoder->v4_books = arena;
+  decoder->v1_books = (decoder_v1_entry_t(*)[DECODER_MAX_ENTRIES])(
+      decoder->v4_books + strips);
+  decoder_reset_strips(decoder);
+}
+
+void decoder_set_output(decoder_t *decoder, uint16_t *output) {
+#ifndef DECODER_ARENA
+  // Frames won't clear our own framebuffer anymore, so finish it now
+  if (output != NULL && output != decoder->framebuffer)
+    decoder_clear_rest(decoder);
+  decoder->output = output != NULL ? output : decoder->framebuffer;
+#else
+  decoder->output = output;
+#endif
 }
 
 const uint16_t *decoder_get_framebuffer(const decoder_t *decoder) {
-  return decoder->framebuffer;
+  return decoder->output;
+}
+
+void decoder_get_dimensions(const decoder_t *decoder, size_t *width,
+                            size_t *height) {
+  *width = DECODER_SCALE * decoder_width(decoder);
+  *height = DECODER_SCALE * decoder_height(decoder);
+}
+
+#ifdef DECODER_STATS
+void decoder_set_stats_clock(decoder_t *decoder,
+                             uint32_t (*clock)(void *context), void *context) {
+  decoder->stats_clock = clock;
+  decoder->stats_clock_context = context;
+}
+
+const decoder_stats_t *decoder_get_frame_stats(const decoder_t *decoder) {
+  return &decoder->stats_frame;
+}
+
+const decoder_stats_t *decoder_get_total_stats(const decoder_t *decoder) {
+  return &decoder->stats_total;
+}
+
+/**
+ * \brief Read the clock for statistics
+ * \return The current time, or zero if there's no clock
+ */
+static uint32_t decoder_stats_now(const decoder_t *decoder) {
+  return decoder->stats_clock != NULL
+             ? decoder->stats_clock(decoder->stats_clock_context)
+             : 0;
+}
+
+/**
+ * \brief Finish counting a frame, and add it to the totals
+ * \param[inout] decoder The decoder that just decoded a frame
+ * \param[in] frame_data Where the frame started
+ */
+static void decoder_stats_finish_frame(decoder_t *decoder,
+                                       const unsigned char *frame_data) {
+  decoder_stats_t *const frame = &decoder->stats_frame;
+  decoder_stats_t *const total = &decoder->stats_total;
+
+  // Finish this frame
+  frame->frames = 1;
+  frame->bytes = decoder->data + decoder->data_index - frame_data;
+  frame->frame_end = decoder_stats_now(decoder);
+  frame->frame_time = frame->frame_end - frame->frame_start;
+
+  // Add it to the totals
+  if (total->frames == 0)
+    total->frame_start = frame->frame_start;
+  total->frame_end = frame->frame_end;
+  total->frames += frame->frames;
+  total->bytes += frame->bytes;
+  total->codebook_entries += frame->codebook_entries;
+  total->v1_blocks += frame->v1_blocks;
+  total->v4_blocks += frame->v4_blocks;
+  total->skipped_blocks += frame->skipped_blocks;
+  total->frame_time += frame->frame_time;
+  for (size_t i = 0; i < DECODER_CHUNK_KINDS; i++)
+    total->chunk_time[i] += frame->chunk_time[i];
+}
+#endif
+
+const bool *decoder_get_dirty_rows(const decoder_t *decoder) {
+  return decoder->dirty;
 }
 
 bool decoder_has_next_frame(const decoder_t *decoder) {
@@ -56,29 +321,83 @@ static size_t decoder_data_remaining(const decoder_t *decoder) {
  * @{
  */
 
+// Vectors are the same in both formats, so their masks are always read this way
+static uint32_t read_i32(const unsigned char *data) {
+  return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | (data[3] << 0);
+}
+
+#ifndef DECODER_NATIVE
 static uint8_t read_i8(const unsigned char *data) { return data[0]; }
 
 static uint16_t read_i16(const unsigned char *data) {
   return (data[0] << 8) | (data[1] << 0);
 }
-static uint32_t read_i32(const unsigned char *data) {
-  return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | (data[3] << 0);
-}
 
-#ifdef DECODER_VALIDATE
 static uint32_t read_i24(const unsigned char *data) {
   return (data[0] << 16) | (data[1] << 8) | (data[2] << 0);
 }
 #endif
+
+#ifdef DECODER_NATIVE
+// The native format is written in the device's byte order, which is
+// little-endian. Everything in it is aligned, so it can be read with plain
+// loads.
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "DECODER_NATIVE only works on little-endian targets"
+#endif
+
+typedef uint16_t __attribute__((may_alias)) decoder_native16_t;
+typedef uint32_t __attribute__((may_alias)) decoder_native32_t;
+
+static uint16_t read_n16(const unsigned char *data) {
+  return *(const decoder_native16_t *)data;
+}
+static uint32_t read_n32(const unsigned char *data) {
+  return *(const decoder_native32_t *)data;
+}
+#endif
 /** @} */
 
 /**
- * \brief Convert CVID YUV to BGR555
+ * \defgroup DECODER_HEADERS
+ * \brief Read fields out of frame and strip headers
  *
- * Note that `u` anv `v` are signed. That's not specified in the format's
- * documentation.
+ * The two formats lay their headers out differently, but frames and strips are
+ * otherwise walked the same way. No bounds checking is done here.
+ *
+ * @{
  */
-static uint16_t yuv_to_bgr555(uint8_t y, int8_t u, int8_t v) {
+#ifdef DECODER_NATIVE
+static size_t decoder_frame_length(const unsigned char *frame_data) {
+  return read_n32(frame_data + 0);
+}
+static size_t decoder_frame_strips(const unsigned char *frame_data) {
+  return read_n16(frame_data + 4);
+}
+static bool decoder_frame_keyframe(const unsigned char *frame_data) {
+  return (read_n16(frame_data + 6) & 0x0001) != 0;
+}
+static size_t decoder_strip_length(const unsigned char *strip_data) {
+  return read_n32(strip_data + 0);
+}
+#else
+static size_t decoder_frame_length(const unsigned char *frame_data) {
+  return read_i24(frame_data + 1);
+}
+static size_t decoder_frame_strips(const unsigned char *frame_data) {
+  return read_i16(frame_data + 8);
+}
+static bool decoder_frame_keyframe(const unsigned char *frame_data) {
+  return (read_i8(frame_data + 0) & 0x01) != 0;
+}
+static size_t decoder_strip_length(const unsigned char *strip_data) {
+  return read_i16(strip_data + 2);
+}
+#endif
+/** @} */
+
+#ifndef DECODER_YUV_LUT
+uint16_t decoder_yuv_to_bgr555(uint8_t y, int8_t u, int8_t v) {
   // Convert to higher bits to avoid precision loss
   int_fast16_t yp = y;
   int_fast16_t up = u;
@@ -99,6 +418,189 @@ static uint16_t yuv_to_bgr555(uint8_t y, int8_t u, int8_t v) {
   return (bd << 10) | (gd << 5) | (rd << 0);
 }
 
+#ifndef DECODER_NATIVE
+/**
+ * \brief Convert a codebook entry from CVID YUV to BGR555
+ *
+ * All four pixels in an entry share the same chrominance.
+ *
+ * \param[out] colors The four converted pixels
+ */
+static void yuv_to_bgr555_entry(uint16_t colors[4], uint8_t y0, uint8_t y1,
+                                uint8_t y2, uint8_t y3, int8_t u, int8_t v) {
+  colors[0] = decoder_yuv_to_bgr555(y0, u, v);
+  colors[1] = decoder_yuv_to_bgr555(y1, u, v);
+  colors[2] = decoder_yuv_to_bgr555(y2, u, v);
+  colors[3] = decoder_yuv_to_bgr555(y3, u, v);
+}
+#endif
+
+#else
+
+/**
+ * \defgroup DECODER_YUV_LUT
+ * \brief Lookup tables for YUV to BGR555 conversion
+ *
+ * Every output channel is the luminance plus some offset depending only on the
+ * chrominance. The offsets range from `-256` to `255`, so the sum lies in
+ * `[-256, 511)`. The channel tables map that sum, biased by 256, to the clamped
+ * and downsampled channel already shifted into position. The offset tables are
+ * indexed by the chrominance reinterpreted as unsigned.
+ *
+ * The tables are generated by the preprocessor, so they're computed with
+ * exactly the same arithmetic as the reference conversion.
+ *
+ * @{
+ */
+
+#define YUV_LUT_REP2(f, i) f(i) f((i) + 1)
+#define YUV_LUT_REP4(f, i) YUV_LUT_REP2(f, i) YUV_LUT_REP2(f, (i) + 2)
+#define YUV_LUT_REP8(f, i) YUV_LUT_REP4(f, i) YUV_LUT_REP4(f, (i) + 4)
+#define YUV_LUT_REP16(f, i) YUV_LUT_REP8(f, i) YUV_LUT_REP8(f, (i) + 8)
+#define YUV_LUT_REP32(f, i) YUV_LUT_REP16(f, i) YUV_LUT_REP16(f, (i) + 16)
+#define YUV_LUT_REP64(f, i) YUV_LUT_REP32(f, i) YUV_LUT_REP32(f, (i) + 32)
+#define YUV_LUT_REP128(f, i) YUV_LUT_REP64(f, i) YUV_LUT_REP64(f, (i) + 64)
+#define YUV_LUT_REP256(f, i) YUV_LUT_REP128(f, i) YUV_LUT_REP128(f, (i) + 128)
+#define YUV_LUT_REP512(f, i) YUV_LUT_REP256(f, i) YUV_LUT_REP256(f, (i) + 256)
+#define YUV_LUT_REP768(f, i) YUV_LUT_REP512(f, i) YUV_LUT_REP256(f, (i) + 512)
+
+#define YUV_LUT_BIAS 256
+#define YUV_LUT_CLAMP(i)                                                       \
+  ((i) - YUV_LUT_BIAS < 0     ? 0                                              \
+   : (i) - YUV_LUT_BIAS > 255 ? 255                                            \
+                              : (i) - YUV_LUT_BIAS)
+#define YUV_LUT_R(i) (YUV_LUT_CLAMP(i) >> 3) << 0,
+#define YUV_LUT_G(i) (YUV_LUT_CLAMP(i) >> 3) << 5,
+#define YUV_LUT_B(i) (YUV_LUT_CLAMP(i) >> 3) << 10,
+
+#define YUV_LUT_SIGNED(i) ((i) < 128 ? (i) : (i) - 256)
+#define YUV_LUT_TWICE(i) YUV_LUT_SIGNED(i) * 2,
+#define YUV_LUT_HALF(i) -(YUV_LUT_SIGNED(i) / 2),
+
+static const uint16_t yuv_lut_r[768] = {YUV_LUT_REP768(YUV_LUT_R, 0)};
+static const uint16_t yuv_lut_g[768] = {YUV_LUT_REP768(YUV_LUT_G, 0)};
+static const uint16_t yuv_lut_b[768] = {YUV_LUT_REP768(YUV_LUT_B, 0)};
+
+static const int16_t yuv_lut_twice[256] = {YUV_LUT_REP256(YUV_LUT_TWICE, 0)};
+static const int16_t yuv_lut_half[256] = {YUV_LUT_REP256(YUV_LUT_HALF, 0)};
+
+/** @} */
+
+uint16_t decoder_yuv_to_bgr555(uint8_t y, int8_t u, int8_t v) {
+  int_fast16_t r = YUV_LUT_BIAS + y + yuv_lut_twice[(uint8_t)v];
+  int_fast16_t g = YUV_LUT_BIAS + y + yuv_lut_half[(uint8_t)u] - v;
+  int_fast16_t b = YUV_LUT_BIAS + y + yuv_lut_twice[(uint8_t)u];
+  return yuv_lut_b[b] | yuv_lut_g[g] | yuv_lut_r[r];
+}
+
+#ifndef DECODER_NATIVE
+/**
+ * \brief Convert a codebook entry from CVID YUV to BGR555
+ *
+ * All four pixels in an entry share the same chrominance, so we only look up
+ * the offsets once. After that, each pixel is three loads.
+ *
+ * \param[out] colors The four converted pixels
+ */
+static void yuv_to_bgr555_entry(uint16_t colors[4], uint8_t y0, uint8_t y1,
+                                uint8_t y2, uint8_t y3, int8_t u, int8_t v) {
+  // Find where in each channel table this chrominance puts us
+  const uint16_t *r = yuv_lut_r + YUV_LUT_BIAS + yuv_lut_twice[(uint8_t)v];
+  const uint16_t *g = yuv_lut_g + YUV_LUT_BIAS + yuv_lut_half[(uint8_t)u] - v;
+  const uint16_t *b = yuv_lut_b + YUV_LUT_BIAS + yuv_lut_twice[(uint8_t)u];
+  // Look up each pixel
+  colors[0] = b[y0] | g[y0] | r[y0];
+  colors[1] = b[y1] | g[y1] | r[y1];
+  colors[2] = b[y2] | g[y2] | r[y2];
+  colors[3] = b[y3] | g[y3] | r[y3];
+}
+#endif
+
+#endif
+
+/**
+ * \brief Pack two pixels into a pair
+ * \see decoder_pair_t
+ */
+static decoder_pair_t pack_pair(uint16_t left, uint16_t right) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return ((decoder_pair_t)left << 16) | ((decoder_pair_t)right << 0);
+#else
+  return ((decoder_pair_t)right << 16) | ((decoder_pair_t)left << 0);
+#endif
+}
+
+/**
+ * \brief Store converted pixels into a codebook entry
+ *
+ * The two codebooks lay their entries out differently, so we need to know
+ * which one we're writing into.
+ *
+ * \param[inout] strip Strip with the codebooks
+ * \param[in] v1 Whether to write into the V1 codebook or the V4 codebook
+ * \param[in] entry_index Which entry to write
+ * \param[in] colors The four pixels of the entry
+ */
+static void decoder_store_entry(decoder_strip_t *strip, bool v1,
+                                size_t entry_index, const uint16_t colors[4]) {
+  if (v1) {
+    decoder_v1_entry_t *entry = strip->v1 + entry_index;
+    entry->c00 = pack_pair(colors[0], colors[0]);
+    entry->c11 = pack_pair(colors[1], colors[1]);
+    entry->c22 = pack_pair(colors[2], colors[2]);
+    entry->c33 = pack_pair(colors[3], colors[3]);
+  } else {
+    decoder_v4_entry_t *entry = strip->v4 + entry_index;
+#ifndef DECODER_UPSCALE
+    entry->c01 = pack_pair(colors[0], colors[1]);
+    entry->c23 = pack_pair(colors[2], colors[3]);
+#else
+    entry->c00 = pack_pair(colors[0], colors[0]);
+    entry->c11 = pack_pair(colors[1], colors[1]);
+    entry->c22 = pack_pair(colors[2], colors[2]);
+    entry->c33 = pack_pair(colors[3], colors[3]);
+#endif
+  }
+}
+
+/**
+ * \brief Distance between rows of the framebuffer, in pairs
+ *
+ * This is a compile-time constant so the block writers can fold it into their
+ * addressing.
+ */
+#define DECODER_STRIDE (DECODER_OUTPUT_WIDTH / 2)
+
+/**
+ * \brief How many pairs wide a block is in the framebuffer
+ */
+#define DECODER_BLOCK_PAIRS (2 * DECODER_SCALE)
+
+/**
+ * \brief Distance between rows of blocks in the framebuffer, in pairs
+ */
+#define DECODER_BLOCK_STRIDE (DECODER_BLOCK_LINES * DECODER_STRIDE)
+
+/**
+ * \brief Find the pair at a given pixel in the framebuffer
+ *
+ * This is only used to set up the vector decode loops. They walk the
+ * framebuffer with pointers after that, so they don't have to multiply.
+ *
+ * The coordinates are in the frame, so they're scaled to find the pixel in the
+ * framebuffer.
+ *
+ * \param[in] framebuffer Buffer to index
+ * \param[in] y Row of the pixel
+ * \param[in] x Column of the pixel, which must be even
+ */
+static decoder_pair_t *decoder_pair_at(uint16_t *framebuffer, uint16_t y,
+                                       uint16_t x) {
+  return (decoder_pair_t *)framebuffer + DECODER_SCALE * y * DECODER_STRIDE +
+         DECODER_SCALE * x / 2;
+}
+
+#ifndef DECODER_UPSCALE
 /**
  * \brief Decode four vectors onto the framebuffer
  *
@@ -106,93 +608,414 @@ static uint16_t yuv_to_bgr555(uint8_t y, int8_t u, int8_t v) {
  * write data onto the framebuffer. It takes the vectors to write, and it looks
  * them up in the codebook to put the data onto the frame.
  *
- * \param[in] strip Strip to use for the codebooks
- * \param[out] framebuffer Buffer to write to
+ * The writes are done a pair of pixels at a time, relative to the top-left of
+ * the block.
+ *
+ * \param[in] codebook The strip's V4 codebook
+ * \param[out] block Top-left pair of the 4x4 block to write to
  * \param[in] vector_entry Four bytes to use to index the V4 table
- * \param[in] y Top of 4x4 block
- * \param[in] x Left of 4x4 block
  */
-static void decoder_write_v4(const decoder_strip_t *strip,
-                             uint16_t *framebuffer,
-                             const unsigned char *vector_entry, uint16_t y,
-                             uint16_t x) {
+static void decoder_write_v4(const decoder_v4_entry_t *codebook,
+                             decoder_pair_t *block,
+                             const unsigned char *vector_entry) {
   // Decode (0,0) - (1,1)
-  decoder_codebook_t codebook_entry_00 = strip->v4[vector_entry[0]];
-  framebuffer[(y + 0) * DECODER_WIDTH + (x + 0)] = codebook_entry_00.c0;
-  framebuffer[(y + 0) * DECODER_WIDTH + (x + 1)] = codebook_entry_00.c1;
-  framebuffer[(y + 1) * DECODER_WIDTH + (x + 0)] = codebook_entry_00.c2;
-  framebuffer[(y + 1) * DECODER_WIDTH + (x + 1)] = codebook_entry_00.c3;
+  const decoder_v4_entry_t *codebook_entry_00 = codebook + vector_entry[0];
+  block[0 * DECODER_STRIDE + 0] = codebook_entry_00->c01;
+  block[1 * DECODER_STRIDE + 0] = codebook_entry_00->c23;
   // Decode (2,0) - (3,1)
-  decoder_codebook_t codebook_entry_20 = strip->v4[vector_entry[1]];
-  framebuffer[(y + 0) * DECODER_WIDTH + (x + 2)] = codebook_entry_20.c0;
-  framebuffer[(y + 0) * DECODER_WIDTH + (x + 3)] = codebook_entry_20.c1;
-  framebuffer[(y + 1) * DECODER_WIDTH + (x + 2)] = codebook_entry_20.c2;
-  framebuffer[(y + 1) * DECODER_WIDTH + (x + 3)] = codebook_entry_20.c3;
+  const decoder_v4_entry_t *codebook_entry_20 = codebook + vector_entry[1];
+  block[0 * DECODER_STRIDE + 1] = codebook_entry_20->c01;
+  block[1 * DECODER_STRIDE + 1] = codebook_entry_20->c23;
   // Decode (0,2) - (1,3)
-  decoder_codebook_t codebook_entry_02 = strip->v4[vector_entry[2]];
-  framebuffer[(y + 2) * DECODER_WIDTH + (x + 0)] = codebook_entry_02.c0;
-  framebuffer[(y + 2) * DECODER_WIDTH + (x + 1)] = codebook_entry_02.c1;
-  framebuffer[(y + 3) * DECODER_WIDTH + (x + 0)] = codebook_entry_02.c2;
-  framebuffer[(y + 3) * DECODER_WIDTH + (x + 1)] = codebook_entry_02.c3;
+  const decoder_v4_entry_t *codebook_entry_02 = codebook + vector_entry[2];
+  block[2 * DECODER_STRIDE + 0] = codebook_entry_02->c01;
+  block[3 * DECODER_STRIDE + 0] = codebook_entry_02->c23;
   // Decode (2,2) - (3,3)
-  decoder_codebook_t codebook_entry_22 = strip->v4[vector_entry[3]];
-  framebuffer[(y + 2) * DECODER_WIDTH + (x + 2)] = codebook_entry_22.c0;
-  framebuffer[(y + 2) * DECODER_WIDTH + (x + 3)] = codebook_entry_22.c1;
-  framebuffer[(y + 3) * DECODER_WIDTH + (x + 2)] = codebook_entry_22.c2;
-  framebuffer[(y + 3) * DECODER_WIDTH + (x + 3)] = codebook_entry_22.c3;
+  const decoder_v4_entry_t *codebook_entry_22 = codebook + vector_entry[3];
+  block[2 * DECODER_STRIDE + 1] = codebook_entry_22->c01;
+  block[3 * DECODER_STRIDE + 1] = codebook_entry_22->c23;
 }
 
 /**
  * \brief Decode one vector onto the framebuffer
  * \see decoder_write_v4()
  */
-static void decoder_write_v1(const decoder_strip_t *strip,
-                             uint16_t *framebuffer,
-                             const unsigned char *vector_entry, uint16_t y,
-                             uint16_t x) {
-  decoder_codebook_t codebook_entry = strip->v1[vector_entry[0]];
+static void decoder_write_v1(const decoder_v1_entry_t *codebook,
+                             decoder_pair_t *block,
+                             const unsigned char *vector_entry) {
+  const decoder_v1_entry_t *codebook_entry = codebook + vector_entry[0];
   // Decode (0,0) - (1,1)
-  framebuffer[(y + 0) * DECODER_WIDTH + (x + 0)] = codebook_entry.c0;
-  framebuffer[(y + 0) * DECODER_WIDTH + (x + 1)] = codebook_entry.c0;
-  framebuffer[(y + 1) * DECODER_WIDTH + (x + 0)] = codebook_entry.c0;
-  framebuffer[(y + 1) * DECODER_WIDTH + (x + 1)] = codebook_entry.c0;
+  block[0 * DECODER_STRIDE + 0] = codebook_entry->c00;
+  block[1 * DECODER_STRIDE + 0] = codebook_entry->c00;
   // Decode (2,0) - (3,1)
-  framebuffer[(y + 0) * DECODER_WIDTH + (x + 2)] = codebook_entry.c1;
-  framebuffer[(y + 0) * DECODER_WIDTH + (x + 3)] = codebook_entry.c1;
-  framebuffer[(y + 1) * DECODER_WIDTH + (x + 2)] = codebook_entry.c1;
-  framebuffer[(y + 1) * DECODER_WIDTH + (x + 3)] = codebook_entry.c1;
+  block[0 * DECODER_STRIDE + 1] = codebook_entry->c11;
+  block[1 * DECODER_STRIDE + 1] = codebook_entry->c11;
   // Decode (0,2) - (1,3)
-  framebuffer[(y + 2) * DECODER_WIDTH + (x + 0)] = codebook_entry.c2;
-  framebuffer[(y + 2) * DECODER_WIDTH + (x + 1)] = codebook_entry.c2;
-  framebuffer[(y + 3) * DECODER_WIDTH + (x + 0)] = codebook_entry.c2;
-  framebuffer[(y + 3) * DECODER_WIDTH + (x + 1)] = codebook_entry.c2;
+  block[2 * DECODER_STRIDE + 0] = codebook_entry->c22;
+  block[3 * DECODER_STRIDE + 0] = codebook_entry->c22;
   // Decode (2,2) - (3,3)
-  framebuffer[(y + 2) * DECODER_WIDTH + (x + 2)] = codebook_entry.c3;
-  framebuffer[(y + 2) * DECODER_WIDTH + (x + 3)] = codebook_entry.c3;
-  framebuffer[(y + 3) * DECODER_WIDTH + (x + 2)] = codebook_entry.c3;
-  framebuffer[(y + 3) * DECODER_WIDTH + (x + 3)] = codebook_entry.c3;
+  block[2 * DECODER_STRIDE + 1] = codebook_entry->c33;
+  block[3 * DECODER_STRIDE + 1] = codebook_entry->c33;
+}
+#else
+/**
+ * \brief Decode four vectors onto the framebuffer, scaled up
+ *
+ * Each vector covers a 4x4 area of the framebuffer. Its entry already has its
+ * colors doubled, so this is the same as writing a V1 block without scaling.
+ *
+ * \see decoder_write_v4()
+ */
+static void decoder_write_v4(const decoder_v4_entry_t *codebook,
+                             decoder_pair_t *block,
+                             const unsigned char *vector_entry) {
+  for (size_t i = 0; i < 4; i++) {
+    const decoder_v4_entry_t *codebook_entry = codebook + vector_entry[i];
+    decoder_pair_t *area = block + (i / 2) * 4 * DECODER_STRIDE + (i % 2) * 2;
+    area[0 * DECODER_STRIDE + 0] = codebook_entry->c00;
+    area[1 * DECODER_STRIDE + 0] = codebook_entry->c00;
+    area[0 * DECODER_STRIDE + 1] = codebook_entry->c11;
+    area[1 * DECODER_STRIDE + 1] = codebook_entry->c11;
+    area[2 * DECODER_STRIDE + 0] = codebook_entry->c22;
+    area[3 * DECODER_STRIDE + 0] = codebook_entry->c22;
+    area[2 * DECODER_STRIDE + 1] = codebook_entry->c33;
+    area[3 * DECODER_STRIDE + 1] = codebook_entry->c33;
+  }
+}
+
+/**
+ * \brief Decode one vector onto the framebuffer, scaled up
+ *
+ * The block is an 8x8 fill, with each color of the entry covering a 4x4 area.
+ *
+ * \see decoder_write_v4()
+ */
+static void decoder_write_v1(const decoder_v1_entry_t *codebook,
+                             decoder_pair_t *block,
+                             const unsigned char *vector_entry) {
+  const decoder_v1_entry_t *codebook_entry = codebook + vector_entry[0];
+  for (size_t y = 0; y < 4; y++) {
+    decoder_pair_t *top = block + y * DECODER_STRIDE;
+    decoder_pair_t *bottom = top + 4 * DECODER_STRIDE;
+    top[0] = codebook_entry->c00;
+    top[1] = codebook_entry->c00;
+    top[2] = codebook_entry->c11;
+    top[3] = codebook_entry->c11;
+    bottom[0] = codebook_entry->c22;
+    bottom[1] = codebook_entry->c22;
+    bottom[2] = codebook_entry->c33;
+    bottom[3] = codebook_entry->c33;
+  }
+}
+#endif
+
+/**
+ * \defgroup DECODER_KERNELS
+ * \brief Write runs of blocks of the same kind
+ *
+ * Intra chunks are written a run at a time. For V1-only chunks, that's a whole
+ * row of the strip. For mixed chunks, it's as many blocks of one kind as there
+ * are in a row in the mask. The vectors for a run are back to back, so the
+ * kernel doesn't have to look at the mask at all.
+ *
+ * With `DECODER_ASM`, these come from the hand-written assembly in `kernels.s`.
+ * Otherwise, they're the versions here, which are the reference for it.
+ *
+ * @{
+ */
+
+#ifdef DECODER_ASM
+#if DECODER_STRIDE != 160 || DECODER_SCALE != 1
+#error "kernels.s assumes rows of 160 pairs, without scaling"
+#endif
+void decoder_kernel_v4_run(decoder_pair_t *block,
+                           const decoder_v4_entry_t *codebook,
+                           const unsigned char *vectors, size_t count);
+void decoder_kernel_v1_run(decoder_pair_t *block,
+                           const decoder_v1_entry_t *codebook,
+                           const unsigned char *vectors, size_t count);
+#else
+/**
+ * \brief Decode a run of V4 blocks, from left to right
+ * \param[out] block Top-left pair of the first block
+ * \param[in] codebook The strip's V4 codebook
+ * \param[in] vectors Four bytes for every block
+ * \param[in] count How many blocks, which must be at least one
+ */
+static inline void decoder_kernel_v4_run(decoder_pair_t *block,
+                                         const decoder_v4_entry_t *codebook,
+                                         const unsigned char *vectors,
+                                         size_t count) {
+  do {
+    decoder_write_v4(codebook, block, vectors);
+    block += DECODER_BLOCK_PAIRS;
+    vectors += 4;
+  } while (--count != 0);
 }
 
+/**
+ * \brief Decode a run of V1 blocks, from left to right
+ * \see decoder_kernel_v4_run()
+ */
+static inline void decoder_kernel_v1_run(decoder_pair_t *block,
+                                         const decoder_v1_entry_t *codebook,
+                                         const unsigned char *vectors,
+                                         size_t count) {
+  do {
+    decoder_write_v1(codebook, block, vectors);
+    block += DECODER_BLOCK_PAIRS;
+    vectors += 1;
+  } while (--count != 0);
+}
+#endif
+
+/** @} */
+
+/**
+ * \defgroup DECODER_CODEBOOK_SHARING
+ * \brief Manage codebooks shared between strips
+ *
+ * Strips point into the decoder's codebook storage, with a reference count for
+ * each codebook. Inheriting a codebook is just pointing at it. Only when a
+ * strip writes into a codebook someone else is using does it get a copy.
+ *
+ * @{
+ */
+
+/**
+ * \brief Find which V4 codebook a strip is using
+ */
+static size_t decoder_v4_slot(const decoder_t *decoder,
+                              const decoder_strip_t *strip) {
+  return (strip->v4 - decoder->v4_books[0]) / DECODER_MAX_ENTRIES;
+}
+
+/**
+ * \brief Find which V1 codebook a strip is using
+ */
+static size_t decoder_v1_slot(const decoder_t *decoder,
+                              const decoder_strip_t *strip) {
+  return (strip->v1 - decoder->v1_books[0]) / DECODER_MAX_ENTRIES;
+}
+
+/**
+ * \brief Point a strip at the previous strip's codebooks
+ *
+ * This is what inter-coded frames do instead of copying the codebooks.
+ *
+ * \param[inout] decoder Decoder with the codebook storage
+ * \param[inout] strip Strip to point
+ * \param[in] strip_previous Strip to take the codebooks from
+ */
+static void decoder_share_codebooks(decoder_t *decoder, decoder_strip_t *strip,
+                                    const decoder_strip_t *strip_previous) {
+  decoder->v4_refs[decoder_v4_slot(decoder, strip)]--;
+  decoder->v1_refs[decoder_v1_slot(decoder, strip)]--;
+  strip->v4 = strip_previous->v4;
+  strip->v1 = strip_previous->v1;
+  decoder->v4_refs[decoder_v4_slot(decoder, strip)]++;
+  decoder->v1_refs[decoder_v1_slot(decoder, strip)]++;
+}
+
+/**
+ * \brief Get a codebook that's safe to write into
+ *
+ * If no one else is using the codebook, it can just be written in place.
+ * Otherwise, it's copied into an unused codebook first. One always exists since
+ * there are as many codebooks as there are strips, and at least two strips are
+ * sharing this one.
+ *
+ * This works for both kinds of codebooks, so everything is in bytes.
+ *
+ * \param[inout] books Start of the codebook storage
+ * \param[inout] refs Reference counts for each codebook
+ * \param[in] slot The codebook currently in use
+ * \param[in] book_size Size of each codebook
+ * \param[in] keep_from Offset of the first byte that won't be overwritten
+ * \return The codebook to write into
+ */
+static size_t decoder_claim_codebook(unsigned char *books, uint8_t *refs,
+                                     size_t slot, size_t book_size,
+                                     size_t keep_from) {
+  // Check if we can write in place
+  if (refs[slot] == 1)
+    return slot;
+
+  // Find an unused slot
+  size_t free_slot = 0;
+  while (refs[free_slot] != 0)
+    free_slot++;
+
+  // Copy over just the parts that won't be overwritten
+  memcpy(books + free_slot * book_size + keep_from,
+         books + slot * book_size + keep_from, book_size - keep_from);
+  // Move over to the new slot
+  refs[slot]--;
+  refs[free_slot] = 1;
+  return free_slot;
+}
+
+/**
+ * \brief Make sure one of a strip's codebooks is only used by it
+ *
+ * This should be called before updating a codebook. The first `overwritten`
+ * entries are about to be replaced, so they aren't copied.
+ *
+ * \param[inout] decoder Decoder with the codebook storage
+ * \param[inout] strip Strip that's about to update its codebook
+ * \param[in] v1 Whether to claim the V1 codebook or the V4 codebook
+ * \param[in] overwritten How many entries at the start will be replaced
+ */
+static void decoder_claim_codebooks(decoder_t *decoder, decoder_strip_t *strip,
+                                    bool v1, size_t overwritten) {
+  if (v1) {
+    size_t slot = decoder_claim_codebook(
+        (unsigned char *)decoder->v1_books, decoder->v1_refs,
+        decoder_v1_slot(decoder, strip), sizeof(decoder->v1_books[0]),
+        overwritten * sizeof(decoder_v1_entry_t));
+    strip->v1 = decoder->v1_books[slot];
+  } else {
+    size_t slot = decoder_claim_codebook(
+        (unsigned char *)decoder->v4_books, decoder->v4_refs,
+        decoder_v4_slot(decoder, strip), sizeof(decoder->v4_books[0]),
+        overwritten * sizeof(decoder_v4_entry_t));
+    strip->v4 = decoder->v4_books[slot];
+  }
+}
+
+/** @} */
+
+/**
+ * \defgroup DECODER_BITS
+ * \brief Read the bitmasks interleaved with chunk data
+ *
+ * Codebook and vector chunks carry big-endian 32-bit masks, which are read
+ * just before the first bit in them is needed. Their bits are used from most
+ * to least significant. We keep the unused bits at the top of the word, with
+ * zeros shifted in below them, so a run of zeros can be measured and skipped
+ * all at once.
+ *
+ * @{
+ */
+
+/**
+ * \brief The unused part of a mask
+ */
+typedef struct decoder_bits_t {
+  uint32_t bits;
+  uint_fast8_t count;
+} decoder_bits_t;
+
+/**
+ * \brief Start using a new mask
+ * \param[out] bits The mask to replace
+ * \param[in] data The next four bytes of the chunk
+ */
+static inline void decoder_bits_fill(decoder_bits_t *bits,
+                                     const unsigned char *data) {
+  bits->bits = read_i32(data);
+  bits->count = 32;
+}
+
+/**
+ * \brief Use the next bit of a mask, which must have one
+ * \return Whether the bit was set
+ */
+static inline bool decoder_bits_take(decoder_bits_t *bits) {
+  bool r = (bits->bits & 0x80000000) != 0;
+  bits->bits <<= 1;
+  bits->count--;
+  return r;
+}
+
+/**
+ * \brief Count how many of the unused bits of a mask are zero before a one
+ *
+ * This doesn't use __builtin_clz(). We can't count on the device's toolchain
+ * having a library routine for it to fall back on, and narrowing it down to a
+ * nibble only takes a few branches.
+ *
+ * \return How many bits can be skipped, up to all the unused ones
+ */
+static inline uint_fast8_t decoder_bits_zeros(const decoder_bits_t *bits) {
+  static const uint8_t nibble_zeros[16] = {4, 3, 2, 2, 1, 1, 1, 1,
+                                           0, 0, 0, 0, 0, 0, 0, 0};
+  uint32_t word = bits->bits;
+  if (word == 0)
+    return bits->count;
+  uint_fast8_t n = 0;
+  if ((word & 0xffff0000) == 0) {
+    n += 16;
+    word <<= 16;
+  }
+  if ((word & 0xff000000) == 0) {
+    n += 8;
+    word <<= 8;
+  }
+  if ((word & 0xf0000000) == 0) {
+    n += 4;
+    word <<= 4;
+  }
+  return n + nibble_zeros[word >> 28];
+}
+
+/**
+ * \brief Count how many of the unused bits of a mask are one before a zero
+ * \see decoder_bits_zeros()
+ */
+static inline uint_fast8_t decoder_bits_ones(const decoder_bits_t *bits) {
+  // The zeros shifted in below the unused bits become ones, so this stops at
+  // the end of the unused bits at the latest
+  const decoder_bits_t inverted = {~bits->bits, bits->count};
+  return decoder_bits_zeros(&inverted);
+}
+
+/**
+ * \brief Use several bits of a mask at once
+ * \param[inout] bits The mask to use
+ * \param[in] n How many bits, which must be at most how many are unused
+ */
+static inline void decoder_bits_skip(decoder_bits_t *bits, uint_fast8_t n) {
+  bits->bits = n < 32 ? bits->bits << n : 0;
+  bits->count -= n;
+}
+
+/** @} */
+
+#ifndef DECODER_NATIVE
 /**
  * \brief Decode a stream of bytes representing a codebook
  *
  * The chunk header data is passed via other parameters. As such, the data
  * should not include the chunk header.
  *
+ * This is a template for the versions below, one per chunk type. It's always
+ * inlined into them, so the flags are constants and every check of them is
+ * folded away.
+ *
+ * \param[inout] decoder Decoder to count statistics in
  * \param[in] codebook_data Bytes for the codebook, not including the header
  * \param[in] codebook_length Length in bytes, not including the header
- * \param[inout] codebook Codebook to decode into
+ * \param[inout] strip Strip with the codebook to decode into
+ * \param[in] v1 Whether to decode into the V1 codebook or the V4 codebook
  * \param[in] bpp12 Whether to use 12bpp or 8bpp mode
  * \param[in] selective Whether to do selective updates
  * \return Whether decoding was successful, and the error if not
  */
-static decoder_status_t
-decoder_compute_codebook(const unsigned char *codebook_data,
-                         size_t codebook_length, decoder_codebook_t *codebook,
-                         bool bpp12, bool selective) {
+static inline __attribute__((always_inline)) decoder_status_t
+decoder_compute_codebook(decoder_t *decoder, const unsigned char *codebook_data,
+                         size_t codebook_length, decoder_strip_t *strip,
+                         bool v1, bool bpp12, bool selective) {
+
+#ifndef DECODER_STATS
+  (void)decoder;
+#else
+  // How many entries we stored
+  uint32_t stats_entries = 0;
+#endif
 
   // Bitmask for which entries to update. This is populated every 32 entries.
-  uint32_t update_mask = 0x00000000;
+  decoder_bits_t update_mask = {0x00000000, 0};
 
   // Decode all codebook entries
   size_t codebook_index = 0;
@@ -206,18 +1029,17 @@ decoder_compute_codebook(const unsigned char *codebook_data,
 
     // Get data pointers
     const unsigned char *entry_data = codebook_data + codebook_index;
-    decoder_codebook_t *entry = codebook + entry_index;
 
     // Fetch the new update mask if we have to. We need to repopulate every 32
     // entries.
-    if (selective && entry_index % 32 == 0) {
+    if (selective && update_mask.count == 0) {
 #ifdef DECODER_VALIDATE
       // Check range
       if (codebook_remaining < 4)
         return ERROR_INVALID_DATA;
 #endif
       // Update
-      update_mask = read_i32(entry_data);
+      decoder_bits_fill(&update_mask, entry_data);
       codebook_index += 4;
       // Recompute
       entry_data += 4;
@@ -226,17 +1048,20 @@ decoder_compute_codebook(const unsigned char *codebook_data,
 #endif
     }
 
-    // Check whether we should skip this block. Clear the update mask to mark
-    // we're done
+    // Skip straight to the next entry that's updated, so we only do work for
+    // the entries that changed. If there isn't one in this mask, we go get the
+    // next mask.
     if (selective) {
-      uint32_t skip_mask = 0x80000000 >> (entry_index % 32);
-      if ((update_mask & skip_mask) == 0) {
-        update_mask &= ~skip_mask;
+      uint_fast8_t skipped = decoder_bits_zeros(&update_mask);
+      decoder_bits_skip(&update_mask, skipped);
+      entry_index += skipped;
+      if (update_mask.count == 0)
         continue;
-      }
+      decoder_bits_skip(&update_mask, 1);
     }
 
     // Update depending on mode
+    uint16_t colors[4];
     if (bpp12) {
 #ifdef DECODER_VALIDATE
       // Validate
@@ -250,11 +1075,8 @@ decoder_compute_codebook(const unsigned char *codebook_data,
       uint8_t y3 = read_i8(entry_data + 3);
       int8_t u = (int8_t)read_i8(entry_data + 4);
       int8_t v = (int8_t)read_i8(entry_data + 5);
-      // Update
-      entry->c0 = yuv_to_bgr555(y0, u, v);
-      entry->c1 = yuv_to_bgr555(y1, u, v);
-      entry->c2 = yuv_to_bgr555(y2, u, v);
-      entry->c3 = yuv_to_bgr555(y3, u, v);
+      // Convert
+      yuv_to_bgr555_entry(colors, y0, y1, y2, y3, u, v);
       // Next iteration
       codebook_index += 6;
 
@@ -269,28 +1091,155 @@ decoder_compute_codebook(const unsigned char *codebook_data,
       uint8_t y1 = read_i8(entry_data + 1);
       uint8_t y2 = read_i8(entry_data + 2);
       uint8_t y3 = read_i8(entry_data + 3);
-      // Update
-      entry->c0 = yuv_to_bgr555(y0, 0, 0);
-      entry->c1 = yuv_to_bgr555(y1, 0, 0);
-      entry->c2 = yuv_to_bgr555(y2, 0, 0);
-      entry->c3 = yuv_to_bgr555(y3, 0, 0);
+      // Convert
+      yuv_to_bgr555_entry(colors, y0, y1, y2, y3, 0, 0);
       // Next iteration
       codebook_index += 4;
     }
 
+#ifdef DECODER_VALIDATE
+    // Make sure the entry exists
+    if (entry_index >= DECODER_MAX_ENTRIES)
+      return ERROR_INVALID_DATA;
+#endif
+    // Update
+    decoder_store_entry(strip, v1, entry_index, colors);
+#ifdef DECODER_STATS
+    stats_entries++;
+#endif
+
+    // Next
+    entry_index++;
+  }
+
+#ifdef DECODER_STATS
+  decoder->stats_frame.codebook_entries += stats_entries;
+#endif
+
+#ifdef DECODER_VALIDATE
+  // Check if we ran out of data prematurely. That is, check that we're not
+  // supposed to get any more blocks in selective mode
+  if (selective && update_mask.bits != 0x00000000)
+    return ERROR_INVALID_DATA;
+#endif
+
+  return SUCCESS;
+}
+
+/**
+ * \brief Define the version of decoder_compute_codebook() for a chunk ID
+ * \see decoder_codebook_variants
+ */
+#define DECODER_CODEBOOK_VARIANT(id, v1, bpp12, selective)                     \
+  static decoder_status_t decoder_compute_codebook_##id(                       \
+      decoder_t *decoder, const unsigned char *codebook_data,                  \
+      size_t codebook_length, decoder_strip_t *strip) {                        \
+    return decoder_compute_codebook(decoder, codebook_data, codebook_length,   \
+                                    strip, v1, bpp12, selective);              \
+  }
+
+DECODER_CODEBOOK_VARIANT(2000, false, true, false)
+DECODER_CODEBOOK_VARIANT(2100, false, true, true)
+DECODER_CODEBOOK_VARIANT(2200, true, true, false)
+DECODER_CODEBOOK_VARIANT(2300, true, true, true)
+DECODER_CODEBOOK_VARIANT(2400, false, false, false)
+DECODER_CODEBOOK_VARIANT(2500, false, false, true)
+DECODER_CODEBOOK_VARIANT(2600, true, false, false)
+DECODER_CODEBOOK_VARIANT(2700, true, false, true)
+
+/**
+ * \brief Every version of decoder_compute_codebook(), by chunk ID
+ *
+ * This is indexed by bits 8 through 10 of the ID, which hold the flags.
+ */
+static decoder_status_t (*const decoder_codebook_variants[8])(
+    decoder_t *decoder, const unsigned char *codebook_data,
+    size_t codebook_length, decoder_strip_t *strip) = {
+    decoder_compute_codebook_2000, decoder_compute_codebook_2100,
+    decoder_compute_codebook_2200, decoder_compute_codebook_2300,
+    decoder_compute_codebook_2400, decoder_compute_codebook_2500,
+    decoder_compute_codebook_2600, decoder_compute_codebook_2700,
+};
+
+#else
+/**
+ * \brief Decode a native codebook chunk
+ *
+ * The entries are already BGR555. They come in runs of consecutive entries.
+ * Each run starts with two 16-bit words: the index of its first entry, and how
+ * many entries it has. Then, each entry is its four pixels in the same order as
+ * CVID, which is also how a V4 entry is laid out in memory.
+ *
+ * \param[inout] decoder Decoder with the codebook storage
+ * \param[in] codebook_data Bytes for the codebook, not including the header
+ * \param[in] codebook_length Length in bytes, not including the header
+ * \param[inout] strip Strip with the codebook to decode into
+ * \param[in] v1 Whether to decode into the V1 codebook or the V4 codebook
+ * \return Whether decoding was successful, and the error if not
+ */
+static decoder_status_t decoder_compute_codebook(
+    decoder_t *decoder, const unsigned char *codebook_data,
+    size_t codebook_length, decoder_strip_t *strip, bool v1) {
+
+  // Make sure no other strip sees the update. If the first run starts at the
+  // first entry, the entries in it don't have to be copied.
+  size_t overwritten = 0;
+  if (codebook_length >= 4 && read_n16(codebook_data + 0) == 0) {
+    overwritten = read_n16(codebook_data + 2);
+    if (overwritten > DECODER_MAX_ENTRIES)
+      overwritten = DECODER_MAX_ENTRIES;
+  }
+  decoder_claim_codebooks(decoder, strip, v1, overwritten);
+
+  // Decode all the runs
+  size_t codebook_index = 0;
+  while (codebook_index < codebook_length) {
+
+#ifdef DECODER_VALIDATE
+    // Check the run header is there
+    if (codebook_length - codebook_index < 4)
+      return ERROR_INVALID_DATA;
+#endif
+    // Read the run header
+    const size_t first = read_n16(codebook_data + codebook_index + 0);
+    const size_t count = read_n16(codebook_data + codebook_index + 2);
+    codebook_index += 4;
+    const unsigned char *const entry_data = codebook_data + codebook_index;
+
+#ifdef DECODER_VALIDATE
+    // Check the entries exist and are all there
+    if (first + count > DECODER_MAX_ENTRIES)
+      return ERROR_INVALID_DATA;
+    if ((codebook_length - codebook_index) / 8 < count)
+      return ERROR_INVALID_DATA;
+#endif
+
+    // V4 entries can be copied as-is, unless they're being scaled up. V1
+    // entries have to have each of their pixels doubled.
+    if (v1 || DECODER_SCALE != 1) {
+      for (size_t i = 0; i < count; i++) {
+        const uint16_t colors[4] = {
+            read_n16(entry_data + 8 * i + 0),
+            read_n16(entry_data + 8 * i + 2),
+            read_n16(entry_data + 8 * i + 4),
+            read_n16(entry_data + 8 * i + 6),
+        };
+        decoder_store_entry(strip, v1, first + i, colors);
+      }
+    } else {
+      memcpy(strip->v4 + first, entry_data, 8 * count);
+    }
+
     // Next
-    entry_index++;
-  }
-
-#ifdef DECODER_VALIDATE
-  // Check if we ran out of data prematurely. That is, check that we're not
-  // supposed to get any more blocks in selective mode
-  if (selective && update_mask != 0x00000000)
-    return ERROR_INVALID_DATA;
+    codebook_index += 8 * count;
+#ifdef DECODER_STATS
+    decoder->stats_frame.codebook_entries += count;
 #endif
+  }
 
   return SUCCESS;
 }
+#endif
 
 /**
  * \brief Decode a set of intra-coded vectors
@@ -299,95 +1248,102 @@ decoder_compute_codebook(const unsigned char *codebook_data,
  * passed via other parameters, so the data and length should not include the
  * header data.
  *
+ * Like decoder_compute_codebook(), this is a template. Use the versions below.
+ *
+ * \param[inout] decoder Decoder with the output to write into
  * \param[in] vector_data The data for the vectors
  * \param[in] vector_length How long the vector data is
  * \param[in] strip The strip with the coordinates and codebook
- * \param[out] framebuffer The frame to write into
  * \param[in] mixed Whether we have mixed V4 and V1 or only V1
  * \return Whether decoding was successful, and the error if not
  */
-static decoder_status_t decoder_compute_intra_vectors(
-    const unsigned char *vector_data, size_t vector_length,
-    const decoder_strip_t *strip, uint16_t *framebuffer, bool mixed) {
+static inline __attribute__((always_inline)) decoder_status_t
+decoder_compute_intra_vectors(decoder_t *decoder,
+                              const unsigned char *vector_data,
+                              size_t vector_length,
+                              const decoder_strip_t *strip, bool mixed) {
 
 #ifndef DECODER_VALIDATE
   (void)vector_length;
 #endif
+#ifdef DECODER_STATS
+  // How many blocks of each kind we wrote
+  uint32_t stats_v1 = 0;
+  uint32_t stats_v4 = 0;
+#endif
+
+  uint16_t *const framebuffer = decoder->output;
 
   // Mask for V4/V1 disambiguation. This is only used in mixed mode, and it's
-  // populated every 32 pixels.
-  uint32_t v4_mask = 0x00000000;
+  // populated every 32 blocks.
+  decoder_bits_t v4_mask = {0x00000000, 0};
 
-  // Iterate over the frame. We're guaranteed that the strip has boundaries on
-  // multiples of four
+  // Iterate over the frame a run at a time. We're guaranteed that the strip
+  // has boundaries on multiples of four
   size_t vector_index = 0;
-  size_t pixel_index = 0;
-  for (uint16_t y = strip->y0; y < strip->y1; y += 4) {
-    for (uint16_t x = strip->x0; x < strip->x1; x += 4) {
-
+  decoder_pair_t *row = decoder_pair_at(framebuffer, strip->y0, strip->x0);
+  const size_t row_blocks = (strip->x1 - strip->x0) / 4;
+  for (uint16_t y = strip->y0; y < strip->y1;
+       y += 4, row += DECODER_BLOCK_STRIDE) {
+    decoder_pair_t *block = row;
+    for (size_t blocks_left = row_blocks; blocks_left != 0;) {
+
+      // Find the next run. Without a mask, it's the rest of the row. With one,
+      // it's as far as the mask has the same bit, which is at least one block.
+      // Runs stop at the end of the mask, since the next mask is between its
+      // vectors, and at the end of the row.
+      bool v4 = false;
+      size_t run = blocks_left;
+      if (mixed) {
+        if (v4_mask.count == 0) {
 #ifdef DECODER_VALIDATE
-      // Check we have enough data
-      if (vector_index > vector_length)
-        return ERROR_INVALID_DATA;
-      size_t vector_remaining = vector_length - vector_index;
+          // Check we have enough space
+          if (vector_length - vector_index < 4)
+            return ERROR_INVALID_DATA;
 #endif
+          decoder_bits_fill(&v4_mask, vector_data + vector_index);
+          vector_index += 4;
+        }
+        v4 = (v4_mask.bits & 0x80000000) != 0;
+        size_t same = v4 ? decoder_bits_ones(&v4_mask)
+                         : decoder_bits_zeros(&v4_mask);
+        if (same < run)
+          run = same;
+        decoder_bits_skip(&v4_mask, run);
+      }
 
-      // Compute where we are
+      // Decode it
       const unsigned char *vector_entry = vector_data + vector_index;
-
-      // If we need to repopulate v4mask, do so
-      if (mixed && pixel_index % 32 == 0) {
-#ifdef DECODER_VALIDATE
-        // Check we have enough space
-        if (vector_remaining < 4)
-          return ERROR_INVALID_DATA;
-#endif
-        // Read
-        v4_mask = read_i32(vector_entry);
-        vector_index += 4;
-        // Recompute
-        vector_entry += 4;
+      const size_t run_length = v4 ? 4 * run : run;
 #ifdef DECODER_VALIDATE
-        vector_remaining -= 4;
+      // Check we have enough data
+      if (vector_length - vector_index < run_length)
+        return ERROR_INVALID_DATA;
 #endif
-      }
-
-      // Figure out what mode we're in
-      bool v4 = false;
-      if (mixed) {
-        uint32_t cur_mask = 0x80000000 >> (pixel_index % 32);
-        if ((v4_mask & cur_mask) != 0)
-          v4 = true;
-      }
-
       if (v4) {
-#ifdef DECODER_VALIDATE
-        // Check we have enough data
-        if (vector_remaining < 4)
-          return ERROR_INVALID_DATA;
+        decoder_kernel_v4_run(block, strip->v4, vector_entry, run);
+#ifdef DECODER_STATS
+        stats_v4 += run;
 #endif
-        // Decode
-        decoder_write_v4(strip, framebuffer, vector_entry, y, x);
-        // Next
-        vector_index += 4;
-
       } else {
-#ifdef DECODER_VALIDATE
-        // Check we have enough data
-        if (vector_remaining < 1)
-          return ERROR_INVALID_DATA;
+        decoder_kernel_v1_run(block, strip->v1, vector_entry, run);
+#ifdef DECODER_STATS
+        stats_v1 += run;
 #endif
-        // Decode
-        decoder_write_v1(strip, framebuffer, vector_entry, y, x);
-        // Next
-        vector_index += 1;
       }
 
       // Next
-      pixel_index++;
+      vector_index += run_length;
+      block += DECODER_BLOCK_PAIRS * run;
+      blocks_left -= run;
     }
   }
 
+#ifdef DECODER_STATS
+  decoder->stats_frame.v1_blocks += stats_v1;
+  decoder->stats_frame.v4_blocks += stats_v4;
+#endif
+
 #ifdef DECODER_VALIDATE
   // Check we consumed all the data
   if (vector_index != vector_length)
@@ -397,105 +1353,157 @@ static decoder_status_t decoder_compute_intra_vectors(
   return SUCCESS;
 }
 
+/**
+ * \brief Define the version of decoder_compute_intra_vectors() for a chunk ID
+ */
+#define DECODER_INTRA_VARIANT(id, mixed)                                       \
+  static decoder_status_t decoder_compute_intra_vectors_##id(                  \
+      decoder_t *decoder, const unsigned char *vector_data,                    \
+      size_t vector_length, const decoder_strip_t *strip) {                    \
+    return decoder_compute_intra_vectors(decoder, vector_data, vector_length,  \
+                                         strip, mixed);                        \
+  }
+
+DECODER_INTRA_VARIANT(3000, true)
+DECODER_INTRA_VARIANT(3200, false)
+
 /**
  * \brief Decode a set of inter-coded vectors
+ *
+ * Unlike intra-coded vectors, these can skip blocks. So, this function also
+ * marks which rows of blocks it actually wrote to in the decoder's dirty rows.
+ *
+ * Each block starts with a bit saying whether it's coded, and skipped blocks
+ * tend to come in long runs. So, we skip each run of them in one step, even if
+ * it crosses rows.
+ *
  * \see decoder_compute_intra_vectors()
  */
 static decoder_status_t decoder_compute_inter_vectors(
-    const unsigned char *vector_data, size_t vector_length,
-    const decoder_strip_t *strip, uint16_t *framebuffer) {
+    decoder_t *decoder, const unsigned char *vector_data, size_t vector_length,
+    const decoder_strip_t *strip) {
 
 #ifndef DECODER_VALIDATE
   (void)vector_length;
 #endif
+#ifdef DECODER_STATS
+  // How many blocks of each kind we wrote or skipped
+  uint32_t stats_v1 = 0;
+  uint32_t stats_v4 = 0;
+  uint32_t stats_skipped = 0;
+#endif
+
+  uint16_t *const framebuffer = decoder->output;
 
   // Mask for our "instructions". These tell us whether to skip a block or how
-  // to interpret it if we're decoding it. Also keep track of how many positions
-  // we've read.
-  uint32_t instr_mask = 0x00000000;
-  size_t instr_index = 0;
+  // to interpret it if we're decoding it.
+  decoder_bits_t instr_mask = {0x00000000, 0};
+
+  // Where we are in the strip. We're guaranteed that the strip has boundaries
+  // on multiples of four.
+  const size_t row_blocks = (strip->x1 - strip->x0) / 4;
+  size_t blocks_left = row_blocks * ((strip->y1 - strip->y0) / 4);
+  size_t column = 0;
+  decoder_pair_t *row = decoder_pair_at(framebuffer, strip->y0, strip->x0);
+  bool *row_dirty = decoder->dirty + strip->y0 / 4;
 
-  // Iterate over the frame. We're guaranteed that the strip has boundaries on
-  // multiples of four
   size_t vector_index = 0;
-  for (uint16_t y = strip->y0; y < strip->y1; y += 4) {
-    for (uint16_t x = strip->x0; x < strip->x1; x += 4) {
+  while (blocks_left != 0) {
 
+    // Read in more instructions if we have to
+    if (instr_mask.count == 0) {
 #ifdef DECODER_VALIDATE
-      // Check we have enough data
-      if (vector_index > vector_length)
+      // Check we have enough space
+      if (vector_length - vector_index < 4)
         return ERROR_INVALID_DATA;
-      size_t vector_remaining = vector_length - vector_index;
 #endif
+      decoder_bits_fill(&instr_mask, vector_data + vector_index);
+      vector_index += 4;
+    }
 
-      // Compute where we are
-      const unsigned char *vector_entry = vector_data + vector_index;
-
-      // Decode the instruction
-      uint_fast8_t instr = 0;
-      for (size_t i = 0; i < 2; i++) {
-        // Read in more instructions if we have to
-        if (instr_index % 32 == 0) {
-#ifdef DECODER_VALIDATE
-          // Check we have enough space
-          if (vector_remaining < 4)
-            return ERROR_INVALID_DATA;
-#endif
-          // Read
-          instr_mask = read_i32(vector_entry);
-          vector_index += 4;
-          // Recompute
-          vector_entry += 4;
-#ifdef DECODER_VALIDATE
-          vector_remaining -= 4;
+    // Skip every block up to the next coded one, or to the end of the mask.
+    // Bits past the end of the strip don't matter.
+    size_t skipped = decoder_bits_zeros(&instr_mask);
+    if (skipped != 0) {
+      decoder_bits_skip(&instr_mask, skipped);
+      if (skipped > blocks_left)
+        skipped = blocks_left;
+#ifdef DECODER_STATS
+      stats_skipped += skipped;
 #endif
-        }
-        // Shift in the new bit
-        uint32_t bit_mask = 0x80000000 >> (instr_index % 32);
-        instr_index++;
-        instr <<= 1;
-        if ((instr_mask & bit_mask) != 0)
-          instr |= 1;
-        // If the first bit was zero, break
-        if (instr == 0)
-          break;
+      blocks_left -= skipped;
+      column += skipped;
+      while (column >= row_blocks) {
+        column -= row_blocks;
+        row += DECODER_BLOCK_STRIDE;
+        row_dirty++;
       }
+      continue;
+    }
 
+    // This block is coded. The next bit says how, and it might be in the next
+    // mask.
+    decoder_bits_skip(&instr_mask, 1);
+    if (instr_mask.count == 0) {
 #ifdef DECODER_VALIDATE
-      // Check we got valid data
-      if (instr != 0b0 && instr != 0b10 && instr != 0b11)
-        return ERROR_INTERNAL;
+      // Check we have enough space
+      if (vector_length - vector_index < 4)
+        return ERROR_INVALID_DATA;
 #endif
+      decoder_bits_fill(&instr_mask, vector_data + vector_index);
+      vector_index += 4;
+    }
+    const bool v4 = decoder_bits_take(&instr_mask);
 
-      // Check if we should skip this block
-      if (instr == 0b0)
-        continue;
+    // Compute where we are
+    const unsigned char *vector_entry = vector_data + vector_index;
+    decoder_pair_t *block = row + DECODER_BLOCK_PAIRS * column;
 
-      if (instr == 0b11) {
+    if (v4) {
 #ifdef DECODER_VALIDATE
-        // Check we have enough data
-        if (vector_remaining < 4)
-          return ERROR_INVALID_DATA;
+      // Check we have enough data
+      if (vector_length - vector_index < 4)
+        return ERROR_INVALID_DATA;
+#endif
+      // Decode
+      decoder_write_v4(strip->v4, block, vector_entry);
+#ifdef DECODER_STATS
+      stats_v4++;
 #endif
-        // Decode
-        decoder_write_v4(strip, framebuffer, vector_entry, y, x);
-        // Next
-        vector_index += 4;
+      // Next
+      vector_index += 4;
 
-      } else if (instr == 0b10) {
+    } else {
 #ifdef DECODER_VALIDATE
-        // Check we have enough data
-        if (vector_remaining < 1)
-          return ERROR_INVALID_DATA;
+      // Check we have enough data
+      if (vector_length - vector_index < 1)
+        return ERROR_INVALID_DATA;
 #endif
-        // Decode
-        decoder_write_v1(strip, framebuffer, vector_entry, y, x);
-        // Next
-        vector_index += 1;
-      }
+      // Decode
+      decoder_write_v1(strip->v1, block, vector_entry);
+#ifdef DECODER_STATS
+      stats_v1++;
+#endif
+      // Next
+      vector_index += 1;
+    }
+
+    // Mark the row, then move on
+    *row_dirty = true;
+    blocks_left--;
+    if (++column == row_blocks) {
+      column = 0;
+      row += DECODER_BLOCK_STRIDE;
+      row_dirty++;
     }
   }
 
+#ifdef DECODER_STATS
+  decoder->stats_frame.v1_blocks += stats_v1;
+  decoder->stats_frame.v4_blocks += stats_v4;
+  decoder->stats_frame.skipped_blocks += stats_skipped;
+#endif
+
 #ifdef DECODER_VALIDATE
   // Check we consumed all the data
   if (vector_index != vector_length)
@@ -505,30 +1513,47 @@ static decoder_status_t decoder_compute_inter_vectors(
   return SUCCESS;
 }
 
+#ifndef DECODER_NATIVE
 /**
  * \brief Decode a single strip
+ *
+ * The strip is decoded into the decoder's output, and the rows it writes to are
+ * marked dirty. The decoder also provides storage for the strip's codebooks.
+ *
+ * \param[inout] decoder Decoder the strip belongs to
  * \param[in] strip_data Bytes corresponding to strip, starting at header
  * \param[in] strip_length Number of valid bytes in `strip_data`
  * \param[in] strip_current Strip to decode into
  * \param[in] strip_previous Previous strip decoded, or `NULL`
- * \param[inout] framebuffer Buffer to decode into
  * \param[in] frame_inter_coded Whether to puse previous strip's codebook
  * \return Whether decoding was successful, and the error if not
  */
 static decoder_status_t
-decoder_compute_strip(const unsigned char *strip_data, size_t strip_length,
-                      decoder_strip_t *strip_current,
+decoder_compute_strip(decoder_t *decoder, const unsigned char *strip_data,
+                      size_t strip_length, decoder_strip_t *strip_current,
                       const decoder_strip_t *strip_previous,
-                      uint16_t *framebuffer, bool frame_inter_coded) {
+                      bool frame_inter_coded) {
+
+  bool *const dirty = decoder->dirty;
 
   // Read the dimensions
   strip_current->x0 = read_i16(strip_data + 6);
   strip_current->x1 = read_i16(strip_data + 10);
   strip_current->y0 = read_i16(strip_data + 4);
   strip_current->y1 = read_i16(strip_data + 8);
+
+  // If our y0 is zero, that actually means that it's relative to the previous
+  // strip (if the previous strip exists). This has to happen before we check
+  // the strip is on the frame.
+  if (strip_current->y0 == 0 && strip_previous != NULL) {
+    strip_current->y0 = strip_previous->y1;
+    strip_current->y1 = strip_previous->y1 + strip_current->y1;
+  }
+
 #ifdef DECODER_VALIDATE
   // Validate. We don't handle strips that don't end on a multiple of four
-  if (strip_current->x1 > DECODER_WIDTH || strip_current->y1 > DECODER_HEIGHT)
+  if (strip_current->x1 > decoder_width(decoder) ||
+      strip_current->y1 > decoder_height(decoder))
     return ERROR_INVALID_DATA;
   if (strip_current->x0 % 4 != 0 || strip_current->x1 % 4 != 0 ||
       strip_current->y0 % 4 != 0 || strip_current->y1 % 4 != 0)
@@ -553,19 +1578,11 @@ decoder_compute_strip(const unsigned char *strip_data, size_t strip_length,
     return ERROR_INTERNAL;
 #endif
 
-  // If our y0 is zero, that actually means that it's relative to the previous
-  // strip (if the previous strip exists)
-  if (strip_current->y0 == 0 && strip_previous != NULL) {
-    strip_current->y0 = strip_previous->y1;
-    strip_current->y1 = strip_previous->y1 + strip_current->y1;
-  }
-
   // If the frame is inter-coded, that means we should use the previous strips
-  // codebooks (if the previous strip exists)
-  if (frame_inter_coded && strip_previous != NULL) {
-    memcpy(strip_current->v1, strip_previous->v1, sizeof(strip_current->v1));
-    memcpy(strip_current->v4, strip_previous->v4, sizeof(strip_current->v4));
-  }
+  // codebooks (if the previous strip exists). We only point to them here. The
+  // copy happens if and when we update them.
+  if (frame_inter_coded && strip_previous != NULL)
+    decoder_share_codebooks(decoder, strip_current, strip_previous);
 
   // Process each chunk. Remember to skip the header data
   for (size_t chunk_index = 12; chunk_index != strip_length;) {
@@ -588,6 +1605,12 @@ decoder_compute_strip(const unsigned char *strip_data, size_t strip_length,
       return ERROR_INVALID_DATA;
 #endif
 
+#ifdef DECODER_STATS
+    // Time the chunk
+    const uint32_t stats_start = decoder_stats_now(decoder);
+    decoder_chunk_kind_t stats_kind;
+#endif
+
     // Decode specific chunk types
     decoder_status_t r;
     switch (chunk_id) {
@@ -603,14 +1626,25 @@ decoder_compute_strip(const unsigned char *strip_data, size_t strip_length,
     case 0x2600:
     case 0x2700: {
       // Figure out what codebook to decode into
-      decoder_codebook_t *codebook =
-          (chunk_id & 0x0200) != 0 ? strip_current->v1 : strip_current->v4;
+      bool v1 = (chunk_id & 0x0200) != 0;
       // Compute the other parameters
       bool bpp12 = (chunk_id & 0x0400) == 0;
       bool selective = (chunk_id & 0x0100) != 0;
-      // Decode
-      r = decoder_compute_codebook(chunk_data + 4, chunk_length - 4, codebook,
-                                   bpp12, selective);
+      // Make sure no other strip sees the update. A full update replaces
+      // entries starting from the first, so those don't have to be copied.
+      size_t overwritten = 0;
+      if (!selective) {
+        overwritten = (chunk_length - 4) / (bpp12 ? 6 : 4);
+        if (overwritten > DECODER_MAX_ENTRIES)
+          overwritten = DECODER_MAX_ENTRIES;
+      }
+      decoder_claim_codebooks(decoder, strip_current, v1, overwritten);
+      // Decode with the version for this chunk type
+      r = decoder_codebook_variants[(chunk_id >> 8) & 0x07](
+          decoder, chunk_data + 4, chunk_length - 4, strip_current);
+#ifdef DECODER_STATS
+      stats_kind = DECODER_CHUNK_CODEBOOK;
+#endif
       break;
     }
 
@@ -618,15 +1652,28 @@ decoder_compute_strip(const unsigned char *strip_data, size_t strip_length,
     case 0x3200: {
       // Figure out whether we have mixed vectors or not
       bool mixed = (chunk_id & 0x0200) == 0;
-      // Decode
-      r = decoder_compute_intra_vectors(chunk_data + 4, chunk_length - 4,
-                                        strip_current, framebuffer, mixed);
+      // Decode with the version for this chunk type
+      decoder_clear_strip(decoder, strip_current, true);
+      r = mixed ? decoder_compute_intra_vectors_3000(
+                      decoder, chunk_data + 4, chunk_length - 4, strip_current)
+                : decoder_compute_intra_vectors_3200(
+                      decoder, chunk_data + 4, chunk_length - 4, strip_current);
+      // Intra-coded vectors write every block in the strip
+      for (uint16_t y = strip_current->y0; y < strip_current->y1; y += 4)
+        dirty[y / 4] = true;
+#ifdef DECODER_STATS
+      stats_kind = mixed ? DECODER_CHUNK_INTRA : DECODER_CHUNK_INTRA_V1;
+#endif
       break;
     }
 
     case 0x3100: {
-      r = decoder_compute_inter_vectors(chunk_data + 4, chunk_length - 4,
-                                        strip_current, framebuffer);
+      decoder_clear_strip(decoder, strip_current, false);
+      r = decoder_compute_inter_vectors(decoder, chunk_data + 4,
+                                        chunk_length - 4, strip_current);
+#ifdef DECODER_STATS
+      stats_kind = DECODER_CHUNK_INTER;
+#endif
       break;
     }
     }
@@ -635,6 +1682,11 @@ decoder_compute_strip(const unsigned char *strip_data, size_t strip_length,
     if (r != SUCCESS)
       return r;
 
+#ifdef DECODER_STATS
+    decoder->stats_frame.chunk_time[stats_kind] +=
+        decoder_stats_now(decoder) - stats_start;
+#endif
+
     // Done
     chunk_index += chunk_length;
   }
@@ -642,21 +1694,297 @@ decoder_compute_strip(const unsigned char *strip_data, size_t strip_length,
   return SUCCESS;
 }
 
+#else
+/**
+ * \brief Decode a single strip in the native format
+ *
+ * The strip's coordinates are already absolute, so they don't depend on the
+ * previous strip. Every chunk is padded to a multiple of four bytes, but its
+ * length doesn't include the padding.
+ *
+ * \see The CVID version of decoder_compute_strip()
+ */
+static decoder_status_t
+decoder_compute_strip(decoder_t *decoder, const unsigned char *strip_data,
+                      size_t strip_length, decoder_strip_t *strip_current,
+                      const decoder_strip_t *strip_previous,
+                      bool frame_inter_coded) {
+
+  bool *const dirty = decoder->dirty;
+
+  // Read the dimensions
+  strip_current->x0 = read_n16(strip_data + 4);
+  strip_current->x1 = read_n16(strip_data + 6);
+  strip_current->y0 = read_n16(strip_data + 8);
+  strip_current->y1 = read_n16(strip_data + 10);
+#ifdef DECODER_VALIDATE
+  // Validate. We don't handle strips that don't end on a multiple of four
+  if (strip_current->x1 > decoder_width(decoder) ||
+      strip_current->y1 > decoder_height(decoder))
+    return ERROR_INVALID_DATA;
+  if (strip_current->x0 % 4 != 0 || strip_current->x1 % 4 != 0 ||
+      strip_current->y0 % 4 != 0 || strip_current->y1 % 4 != 0)
+    return ERROR_INVALID_DATA;
+  if (strip_current->x0 >= strip_current->x1 ||
+      strip_current->y0 >= strip_current->y1)
+    return ERROR_INVALID_DATA;
+#endif
+
+  // Inherit codebooks the same way as CVID
+  if (frame_inter_coded && strip_previous != NULL)
+    decoder_share_codebooks(decoder, strip_current, strip_previous);
+
+  // Process each chunk. Remember to skip the header data
+  for (size_t chunk_index = 12; chunk_index != strip_length;) {
+    const unsigned char *chunk_data = strip_data + chunk_index;
+
+#ifdef DECODER_VALIDATE
+    // Make sure the chunk header exists
+    if (chunk_index + 4 > strip_length)
+      return ERROR_INVALID_DATA;
+#endif
+    // Read the chunk header
+    uint16_t chunk_id = read_n16(chunk_data + 0);
+    size_t chunk_length = read_n16(chunk_data + 2);
+    size_t chunk_padded = (chunk_length + 3) & ~(size_t)3;
+
+#ifdef DECODER_VALIDATE
+    // Check the length is good
+    if (chunk_length < 4)
+      return ERROR_INVALID_DATA;
+    if (chunk_index + chunk_padded > strip_length)
+      return ERROR_INVALID_DATA;
+#endif
+
+#ifdef DECODER_STATS
+    // Time the chunk
+    const uint32_t stats_start = decoder_stats_now(decoder);
+    decoder_chunk_kind_t stats_kind;
+#endif
+
+    // Decode specific chunk types
+    decoder_status_t r;
+    switch (chunk_id) {
+    default:
+      return ERROR_INVALID_DATA;
+
+    case 0x2000:
+    case 0x2200: {
+      bool v1 = (chunk_id & 0x0200) != 0;
+      r = decoder_compute_codebook(decoder, chunk_data + 4, chunk_length - 4,
+                                   strip_current, v1);
+#ifdef DECODER_STATS
+      stats_kind = DECODER_CHUNK_CODEBOOK;
+#endif
+      break;
+    }
+
+    case 0x3000:
+    case 0x3200: {
+      bool mixed = (chunk_id & 0x0200) == 0;
+      decoder_clear_strip(decoder, strip_current, true);
+      r = mixed ? decoder_compute_intra_vectors_3000(
+                      decoder, chunk_data + 4, chunk_length - 4, strip_current)
+                : decoder_compute_intra_vectors_3200(
+                      decoder, chunk_data + 4, chunk_length - 4, strip_current);
+      for (uint16_t y = strip_current->y0; y < strip_current->y1; y += 4)
+        dirty[y / 4] = true;
+#ifdef DECODER_STATS
+      stats_kind = mixed ? DECODER_CHUNK_INTRA : DECODER_CHUNK_INTRA_V1;
+#endif
+      break;
+    }
+
+    case 0x3100: {
+      decoder_clear_strip(decoder, strip_current, false);
+      r = decoder_compute_inter_vectors(decoder, chunk_data + 4,
+                                        chunk_length - 4, strip_current);
+#ifdef DECODER_STATS
+      stats_kind = DECODER_CHUNK_INTER;
+#endif
+      break;
+    }
+    }
+
+    // Check success
+    if (r != SUCCESS)
+      return r;
+
+#ifdef DECODER_STATS
+    decoder->stats_frame.chunk_time[stats_kind] +=
+        decoder_stats_now(decoder) - stats_start;
+#endif
+
+    // Done
+    chunk_index += chunk_padded;
+  }
+
+  return SUCCESS;
+}
+#endif
+
+/**
+ * \brief Read the frame at some offset into the staging buffer
+ *
+ * This does nothing if the whole stream is in memory. Otherwise, it reads the
+ * frame header, then as much of the rest of the frame as fits. A short read
+ * just leaves less data, so a missing or truncated frame is handled when it's
+ * decoded, the same as it would be in memory.
+ *
+ * \param[inout] decoder The decoder to read into
+ * \param[in] offset Where the frame is in the stream
+ */
+static void decoder_load_frame(decoder_t *decoder, size_t offset) {
+
+  // Nothing to do if we have everything
+  if (decoder->read == NULL)
+    return;
+
+  // Start over with an empty buffer
+  decoder->data_offset = offset;
+  decoder->data_index = 0;
+
+  // Read the header first to get the length
+  const size_t header_length = decoder->staging_length < DECODER_FRAME_HEADER
+                                   ? decoder->staging_length
+                                   : DECODER_FRAME_HEADER;
+  decoder->data_length = decoder->read(decoder->read_context, decoder->staging,
+                                       offset, header_length);
+  if (decoder->data_length < DECODER_FRAME_HEADER)
+    return;
+
+  // Then read the rest, but only what fits. Remember that the length includes
+  // the header.
+  size_t frame_length = decoder_frame_length(decoder->staging);
+  if (frame_length > decoder->staging_length)
+    frame_length = decoder->staging_length;
+  if (frame_length > DECODER_FRAME_HEADER)
+    decoder->data_length += decoder->read(
+        decoder->read_context, decoder->staging + DECODER_FRAME_HEADER,
+        offset + DECODER_FRAME_HEADER, frame_length - DECODER_FRAME_HEADER);
+}
+
+void decoder_initialize_reader(decoder_t *decoder,
+                               size_t (*read)(void *context, void *buffer,
+                                              size_t offset, size_t length),
+                               void *context, void *staging,
+                               size_t staging_length) {
+
+  // Read through the staging buffer
+  decoder->read = read;
+  decoder->read_context = context;
+  decoder->staging = staging;
+  decoder->staging_length = staging_length;
+  decoder->data = staging;
+
+  decoder_reset(decoder);
+
+  // Have the first frame ready
+  decoder_load_frame(decoder, 0);
+}
+
+decoder_status_t decoder_peek_frame(const decoder_t *decoder,
+                                    decoder_frame_info_t *info) {
+
+  // Check we have data to read
+  if (!decoder_has_next_frame(decoder))
+    return ERROR_EOF;
+
+#ifdef DECODER_VALIDATE
+  // Check that we have a frame header
+  if (decoder_data_remaining(decoder) < DECODER_FRAME_HEADER)
+    return ERROR_INVALID_DATA;
+#endif
+
+  // Read the header
+  const unsigned char *const frame_data = decoder->data + decoder->data_index;
+  info->offset = decoder->data_offset + decoder->data_index;
+  info->length = decoder_frame_length(frame_data);
+  info->strips = decoder_frame_strips(frame_data);
+  info->keyframe = decoder_frame_keyframe(frame_data);
+
+#ifdef DECODER_VALIDATE
+  // Check the frame fits. Remember that the length includes the header.
+  if (info->length < DECODER_FRAME_HEADER ||
+      info->length > decoder_data_remaining(decoder))
+    return ERROR_INVALID_DATA;
+#ifdef DECODER_NATIVE
+  // The next frame has to stay aligned
+  if (info->length % 4 != 0)
+    return ERROR_INVALID_DATA;
+#endif
+#endif
+
+  return SUCCESS;
+}
+
+decoder_status_t decoder_skip_frame(decoder_t *decoder) {
+  decoder_frame_info_t info;
+  decoder_status_t r = decoder_peek_frame(decoder, &info);
+  if (r != SUCCESS)
+    return r;
+  decoder->data_index += info.length;
+  decoder_load_frame(decoder, decoder->data_offset + decoder->data_index);
+  return SUCCESS;
+}
+
+decoder_status_t decoder_seek_keyframe(decoder_t *decoder,
+                                       const decoder_frame_info_t *frame) {
+#ifdef DECODER_VALIDATE
+  // Check we're actually going to a keyframe
+  if (!frame->keyframe)
+    return ERROR_INVALID_DATA;
+#endif
+
+  // If we're reading through a callback, the frame has to be read in first.
+  // Then, it's at the start of the staging buffer.
+  decoder_load_frame(decoder, frame->offset);
+  const size_t index = decoder->read != NULL ? 0 : frame->offset;
+
+#ifdef DECODER_VALIDATE
+  // Check the frame is there and agrees with the index
+  if (index >= decoder->data_length)
+    return ERROR_EOF;
+  if (!decoder_frame_keyframe(decoder->data + index))
+    return ERROR_INVALID_DATA;
+#endif
+  decoder->data_index = index;
+  return SUCCESS;
+}
+
 decoder_status_t decoder_compute_frame(decoder_t *decoder) {
 
   // Check we have data to decode
   if (!decoder_has_next_frame(decoder))
     return ERROR_EOF;
 
+#ifdef DECODER_STATS
+  // Start counting this frame
+  memset(&decoder->stats_frame, 0, sizeof(decoder->stats_frame));
+  decoder->stats_frame.frame_start = decoder_stats_now(decoder);
+#endif
+
 #ifdef DECODER_VALIDATE
   // Check that we have a frame header
-  if (decoder_data_remaining(decoder) < 10)
+  if (decoder_data_remaining(decoder) < DECODER_FRAME_HEADER)
     return ERROR_INVALID_DATA;
 #endif
 
-  // Check the dimensions of the frame
+  // Check the dimensions of the frame. The native format doesn't have them,
+  // since they were checked when it was written.
   const unsigned char *const frame_data = decoder->data + decoder->data_index;
+#if defined(DECODER_ANY_SIZE)
+  // Anything that fits in the framebuffer will do
+  const size_t frame_width = read_i16(frame_data + 4);
+  const size_t frame_height = read_i16(frame_data + 6);
 #ifdef DECODER_VALIDATE
+  if (frame_width > DECODER_WIDTH || frame_height > DECODER_HEIGHT ||
+      frame_width % 4 != 0 || frame_height % 4 != 0)
+    return ERROR_BAD_DIMENSIONS;
+#endif
+  decoder->width = frame_width;
+  decoder->height = frame_height;
+#elif defined(DECODER_VALIDATE) && !defined(DECODER_NATIVE)
   const size_t frame_width = read_i16(frame_data + 4);
   const size_t frame_height = read_i16(frame_data + 6);
   if (frame_width != DECODER_WIDTH || frame_height != DECODER_HEIGHT)
@@ -664,28 +1992,37 @@ decoder_status_t decoder_compute_frame(decoder_t *decoder) {
 #endif
 
   // Pull out the other data
-  const bool frame_inter_coded = (read_i8(frame_data + 0) & 0x01) == 0;
-  const size_t frame_strips = read_i16(frame_data + 8);
+  const bool frame_inter_coded = !decoder_frame_keyframe(frame_data);
+  const size_t frame_strips = decoder_frame_strips(frame_data);
 
 #ifdef DECODER_VALIDATE
   // Get the frame length for error checking. Note that the frame length
   // includes the header.
-  const size_t frame_length = read_i24(frame_data + 1);
-  if (frame_length < 10)
+  const size_t frame_length = decoder_frame_length(frame_data);
+  if (frame_length < DECODER_FRAME_HEADER)
     return ERROR_INVALID_DATA;
 #endif
 
   // Done with the frame header
-  decoder->data_index += 10;
+  decoder->data_index += DECODER_FRAME_HEADER;
+
+  // Nothing has been written for this frame yet
+  memset(decoder->dirty, 0, sizeof(decoder->dirty));
 
 #ifdef DECODER_VALIDATE
-  // Validate number of strips
-  if (frame_strips > DECODER_MAX_STRIPS)
+  // Validate number of strips. We only have codebooks for so many.
+  if (frame_strips > decoder->max_strips)
     return ERROR_INVALID_DATA;
 #endif
   // Provide a fast track if no strips
-  if (frame_strips == 0)
+  if (frame_strips == 0) {
+#ifdef DECODER_STATS
+    decoder_stats_finish_frame(decoder, frame_data);
+#endif
+    decoder_clear_rest(decoder);
+    decoder_load_frame(decoder, decoder->data_offset + decoder->data_index);
     return SUCCESS;
+  }
 
   // Decode all the strips
   for (size_t i = 0; i < frame_strips; i++) {
@@ -700,11 +2037,15 @@ decoder_status_t decoder_compute_frame(decoder_t *decoder) {
     const unsigned char *const strip_data = decoder->data + decoder->data_index;
 
     // Read the size of the strip. This includes the size of the header
-    size_t strip_length = read_i16(strip_data + 2);
+    size_t strip_length = decoder_strip_length(strip_data);
 #ifdef DECODER_VALIDATE
     // Validate
     if (strip_length < 12)
       return ERROR_INVALID_DATA;
+#ifdef DECODER_NATIVE
+    if (strip_length % 4 != 0)
+      return ERROR_INVALID_DATA;
+#endif
     if (decoder_data_remaining(decoder) < strip_length)
       return ERROR_INVALID_DATA;
 #endif
@@ -715,12 +2056,16 @@ decoder_status_t decoder_compute_frame(decoder_t *decoder) {
         i > 0 ? decoder->strips + (i - 1) : NULL;
 
     // Try decode
-    decoder_status_t r = decoder_compute_strip(
-        strip_data, strip_length, strip_current, strip_previous,
-        decoder->framebuffer, frame_inter_coded);
+    decoder_status_t r =
+        decoder_compute_strip(decoder, strip_data, strip_length, strip_current,
+                              strip_previous, frame_inter_coded);
     if (r != SUCCESS)
       return r;
 
+    // Let the player know
+    if (decoder->strip_callback != NULL)
+      decoder->strip_callback(decoder->strip_callback_context, strip_current);
+
     // If it worked, go to the next strip
     decoder->data_index += strip_length;
   }
@@ -731,5 +2076,15 @@ decoder_status_t decoder_compute_frame(decoder_t *decoder) {
     return ERROR_INVALID_DATA;
 #endif
 
+#ifdef DECODER_STATS
+  decoder_stats_finish_frame(decoder, frame_data);
+#endif
+
+  // Anything the frame didn't cover is still black
+  decoder_clear_rest(decoder);
+
+  // Have the next frame ready
+  decoder_load_frame(decoder, decoder->data_offset + decoder->data_index);
+
   return SUCCESS;
 }
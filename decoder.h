@@ -3,16 +3,22 @@
  * \brief Decode raw cinepak data to BGR555 frames
  *
  * The interface presented in this file expects the input to be raw CVID data,
- * meaning no containers like AVI. It expects it to be 320x240, and it should be
- * at 15fps (though frame synchronization must be handled by the player). The
- * library decodes individual frames into BGR555 format. It then exposes a
- * reference to the current framebuffer.
+ * meaning no containers like AVI. It expects it to be `DECODER_WIDTH` by
+ * `DECODER_HEIGHT`, which is 320x240 unless they're defined otherwise, and it
+ * should be at 15fps (though frame synchronization must be handled by the
+ * player). The library decodes individual frames into BGR555 format. It then
+ * exposes a reference to the current framebuffer.
  *
  * Cinepak is a proprietary format, so there's not much documentation to go off
  * of. The main sources are: [Ferguson][1] and the [FFMPEG Source][2]. FFMPEG is
  * taken to be the reference implementation. If it differs from the
  * specification I follow that.
  *
+ * If `DECODER_NATIVE` is defined, the decoder instead expects the pre-decoded
+ * format written by `mknative`, which is described there. It has the same
+ * frames and vectors, but its codebooks are already BGR555 and its headers are
+ * simpler to read.
+ *
  * [1]: https://multimedia.cx/mirror/cinepak.txt
  * [2]: https://github.com/FFmpeg/FFmpeg/blob/release/6.0/libavcodec/cinepak.c
  */
@@ -25,14 +31,79 @@
 
 /**
  * \defgroup DECODER_DIMENSIONS
- * \brief Dimensions of the screen, in pixels
+ * \brief Dimensions of the frames, in pixels
+ *
+ * These can be defined to decode some other size. They're constants, so the
+ * framebuffer's stride is folded into the block writers either way. They have
+ * to be multiples of four, since that's what blocks are.
+ *
+ * If `DECODER_ANY_SIZE` is defined, frames that are smaller than this are
+ * accepted too. They're decoded into the top-left of the framebuffer, which is
+ * still `DECODER_OUTPUT_WIDTH` wide, and decoder_get_dimensions() says how
+ * much of it they cover. This is meant for the test harness. The native format
+ * doesn't have dimensions, so it doesn't work with that.
  * @{
  */
+#ifndef DECODER_WIDTH
 #define DECODER_WIDTH 320
+#endif
+#ifndef DECODER_HEIGHT
 #define DECODER_HEIGHT 240
-#define DECODER_PIXELS (320 * 240)
+#endif
+#define DECODER_PIXELS (DECODER_WIDTH * DECODER_HEIGHT)
+/** @} */
+
+/**
+ * \defgroup DECODER_OUTPUT
+ * \brief Dimensions of the framebuffer, in pixels
+ *
+ * If `DECODER_UPSCALE` is defined, every pixel of a frame is written as a 2x2
+ * square, so the framebuffer is twice as wide and twice as tall as the frames.
+ * This way, a quarter-size video can fill the screen without a separate pass
+ * to scale it up. Otherwise, the framebuffer is the same size as the frames.
+ * @{
+ */
+#ifdef DECODER_UPSCALE
+#define DECODER_SCALE 2
+#else
+#define DECODER_SCALE 1
+#endif
+#define DECODER_OUTPUT_WIDTH (DECODER_SCALE * DECODER_WIDTH)
+#define DECODER_OUTPUT_HEIGHT (DECODER_SCALE * DECODER_HEIGHT)
+#define DECODER_OUTPUT_PIXELS (DECODER_OUTPUT_WIDTH * DECODER_OUTPUT_HEIGHT)
 /** @} */
 
+#if DECODER_WIDTH % 4 != 0 || DECODER_HEIGHT % 4 != 0
+#error "DECODER_WIDTH and DECODER_HEIGHT must be multiples of four"
+#endif
+#if defined(DECODER_ANY_SIZE) && defined(DECODER_NATIVE)
+#error "The native format doesn't say what size its frames are"
+#endif
+
+/**
+ * \brief Number of rows of 4x4 blocks in a frame
+ *
+ * The decoder tracks which parts of the frame changed at this granularity.
+ */
+#define DECODER_BLOCK_ROWS (DECODER_HEIGHT / 4)
+
+/**
+ * \brief Number of lines of the framebuffer each row of blocks covers
+ */
+#define DECODER_BLOCK_LINES (4 * DECODER_SCALE)
+
+/**
+ * \brief Length of a frame header in bytes
+ *
+ * This depends on the format of the stream. No frame is shorter than this, so
+ * it also bounds how many frames a stream of some length can have.
+ */
+#ifdef DECODER_NATIVE
+#define DECODER_FRAME_HEADER 8
+#else
+#define DECODER_FRAME_HEADER 10
+#endif
+
 /**
  * \brief Maximum number of codebook entries per strip
  *
@@ -49,27 +120,67 @@
 #define DECODER_MAX_STRIPS 32
 
 /**
- * \brief A single codebook entry
+ * \brief Two horizontally adjacent BGR555 pixels
+ *
+ * Blocks always start on a multiple of four pixels, so every pair of pixels in
+ * a block is 32-bit aligned in the framebuffer. Codebook entries are stored as
+ * these pairs so the block writers can do one 32-bit store per two pixels.
+ *
+ * The left pixel is in the half with the lower address. This type may alias
+ * the `uint16_t` framebuffer.
+ */
+typedef uint32_t __attribute__((may_alias)) decoder_pair_t;
+
+/**
+ * \brief A single V4 codebook entry
  *
  * Recall that each strip in CVID has a V1 and a V4 codebook associated with it.
  * Each entry in those codebooks has four luminance entries and two chrominance
- * entries. However, these are stored decoded as RGB555.
+ * entries. However, these are stored decoded as BGR555.
+ *
+ * A V4 entry covers a 2x2 area. So, we store the top row and the bottom row as
+ * pairs. With `DECODER_UPSCALE`, the area is 4x4 in the framebuffer, so each
+ * color is duplicated into a pair instead, just like for V1 entries.
+ */
+#ifndef DECODER_UPSCALE
+typedef struct decoder_v4_entry_t {
+  decoder_pair_t c01;
+  decoder_pair_t c23;
+} decoder_v4_entry_t;
+#else
+typedef struct decoder_v4_entry_t {
+  decoder_pair_t c00;
+  decoder_pair_t c11;
+  decoder_pair_t c22;
+  decoder_pair_t c33;
+} decoder_v4_entry_t;
+#endif
+
+/**
+ * \brief A single V1 codebook entry
  *
- * Note that this structure is used for *both* the V1 and V4 codebooks, even
- * though it has slightly different meanings for them.
+ * A V1 entry covers a 4x4 area, with each of its colors scaled up to cover a
+ * 2x2 area. So, we store each color duplicated into a pair.
+ *
+ * \see decoder_v4_entry_t
  */
-typedef struct decoder_codebook_t {
-  uint16_t c0;
-  uint16_t c1;
-  uint16_t c2;
-  uint16_t c3;
-} decoder_codebook_t;
+typedef struct decoder_v1_entry_t {
+  decoder_pair_t c00;
+  decoder_pair_t c11;
+  decoder_pair_t c22;
+  decoder_pair_t c33;
+} decoder_v1_entry_t;
 
 /**
  * \brief Structure containing the state for a single strip
  *
  * Each strip has its own dimensions, and maintains its own codebooks. This
  * struct encapsulates that data.
+ *
+ * Inter-coded frames start each strip with the previous strip's codebooks.
+ * Rather than copying them, strips point to codebooks stored in the decoder,
+ * and several strips may share one. A strip only gets a copy of its own when
+ * it actually updates a shared codebook.
  */
 typedef struct decoder_strip_t {
 
@@ -78,25 +189,128 @@ typedef struct decoder_strip_t {
   uint16_t y0;
   uint16_t y1;
 
-  decoder_codebook_t v4[DECODER_MAX_ENTRIES];
-  decoder_codebook_t v1[DECODER_MAX_ENTRIES];
+  decoder_v4_entry_t *v4;
+  decoder_v1_entry_t *v1;
 
 } decoder_strip_t;
 
+#ifdef DECODER_STATS
+/**
+ * \brief Kinds of chunks the decoder keeps time for
+ */
+typedef enum decoder_chunk_kind_t {
+  /** Chunks 0x2000 through 0x2700 */
+  DECODER_CHUNK_CODEBOOK,
+  /** Chunk 0x3000 */
+  DECODER_CHUNK_INTRA,
+  /** Chunk 0x3100 */
+  DECODER_CHUNK_INTER,
+  /** Chunk 0x3200 */
+  DECODER_CHUNK_INTRA_V1,
+  /** How many kinds there are */
+  DECODER_CHUNK_KINDS,
+} decoder_chunk_kind_t;
+
+/**
+ * \brief Counters for the work done decoding
+ *
+ * These are only kept if `DECODER_STATS` is defined. The decoder keeps one set
+ * for the last frame decoded, and one set for every frame since it was
+ * initialized.
+ *
+ * Times are in whatever units the clock passed to decoder_set_stats_clock()
+ * counts in. They're all zero if no clock was given. For the totals,
+ * `frame_start` is when the first frame started and `frame_end` is when the
+ * last one ended.
+ */
+typedef struct decoder_stats_t {
+  uint32_t frames;
+  uint32_t bytes;
+  uint32_t codebook_entries;
+  uint32_t v1_blocks;
+  uint32_t v4_blocks;
+  uint32_t skipped_blocks;
+  uint32_t frame_start;
+  uint32_t frame_end;
+  uint32_t frame_time;
+  uint32_t chunk_time[DECODER_CHUNK_KINDS];
+} decoder_stats_t;
+#endif
+
 /**
  * \brief Top-level state for the decoder
  *
  * This keeps track of the data, as well as where we are inside it. It also
  * holds all the strips, as well as the current framebuffer.
+ *
+ * If the data is read through a callback, `data` points to the staging buffer,
+ * which holds the next frame to decode. Then, `data_offset` is where that frame
+ * is in the stream. Otherwise, `data` is the whole stream and `data_offset` is
+ * always zero.
+ *
+ * The codebooks the strips point to are kept in storage with room for
+ * `max_strips` of each kind. There's a reference count for each of them. Every
+ * strip always points to exactly one V4 and one V1 codebook, so there are
+ * always enough of them to go around, as long as no frame has more than
+ * `max_strips` strips.
+ *
+ * By default, the storage is in the decoder, with room for `DECODER_MAX_STRIPS`
+ * strips, and so is a framebuffer. With `DECODER_ARENA`, neither is. The caller
+ * gives the decoder an arena with decoder_set_arena(), sized for the most
+ * strips the video actually has, and somewhere to write frames with
+ * decoder_set_output(). That saves a lot of memory, since encoders only use a
+ * few strips, and the player never decodes into the decoder's framebuffer.
+ *
+ * The decoder's own framebuffer isn't cleared when it's initialized. Instead,
+ * `uncleared` keeps track of which rows of blocks still need to be, until
+ * `clear_pending` says they all have been. The first frame normally overwrites
+ * all of them anyway.
  */
 typedef struct decoder_t {
 
   const unsigned char *data;
   size_t data_index;
   size_t data_length;
+  size_t data_offset;
+
+  size_t (*read)(void *context, void *buffer, size_t offset, size_t length);
+  void *read_context;
+  unsigned char *staging;
+  size_t staging_length;
 
   decoder_strip_t strips[DECODER_MAX_STRIPS];
-  uint16_t framebuffer[DECODER_WIDTH * DECODER_HEIGHT];
+  size_t max_strips;
+
+  decoder_v4_entry_t (*v4_books)[DECODER_MAX_ENTRIES];
+  decoder_v1_entry_t (*v1_books)[DECODER_MAX_ENTRIES];
+  uint8_t v4_refs[DECODER_MAX_STRIPS];
+  uint8_t v1_refs[DECODER_MAX_STRIPS];
+
+#ifndef DECODER_ARENA
+  decoder_v4_entry_t v4_storage[DECODER_MAX_STRIPS][DECODER_MAX_ENTRIES];
+  decoder_v1_entry_t v1_storage[DECODER_MAX_STRIPS][DECODER_MAX_ENTRIES];
+  uint16_t framebuffer[DECODER_OUTPUT_PIXELS]
+      __attribute__((aligned(sizeof(decoder_pair_t))));
+  bool clear_pending;
+  bool uncleared[DECODER_BLOCK_ROWS];
+#endif
+
+  uint16_t *output;
+  bool dirty[DECODER_BLOCK_ROWS];
+#ifdef DECODER_ANY_SIZE
+  uint16_t width;
+  uint16_t height;
+#endif
+
+  void (*strip_callback)(void *context, const decoder_strip_t *strip);
+  void *strip_callback_context;
+
+#ifdef DECODER_STATS
+  decoder_stats_t stats_frame;
+  decoder_stats_t stats_total;
+  uint32_t (*stats_clock)(void *context);
+  void *stats_clock_context;
+#endif
 
 } decoder_t;
 
@@ -105,18 +319,191 @@ typedef struct decoder_t {
  *
  * Any decoder must be initialized before using it to decode frames.
  *
+ * With `DECODER_NATIVE`, the data must be aligned to four bytes.
+ *
  * \param[in] decoder The structure to initialize
  * \param[in] data The data to decode
  * \param[in] length The length of the data in bytes
  */
 void decoder_initialize(decoder_t *decoder, const void *data, size_t length);
 
+/**
+ * \brief Initialize a decoder that reads its data as it goes
+ *
+ * Instead of having the whole stream in memory, the decoder reads one frame at
+ * a time into a staging buffer supplied by the caller. That way, memory use
+ * doesn't depend on how long the video is, and the video can come from
+ * anywhere, like a block device.
+ *
+ * The callback reads `length` bytes starting at `offset` in the stream into
+ * `buffer`. It returns how many bytes it read, which is only less than
+ * `length` at the end of the stream. The decoder reads each frame just after
+ * finishing the one before it, so this might be called from inside
+ * decoder_compute_frame(), decoder_skip_frame(), and decoder_seek_keyframe().
+ * The first frame is read here.
+ *
+ * The staging buffer must hold the largest frame in the video. Larger frames
+ * are cut short, which is reported as invalid data if `DECODER_VALIDATE` is
+ * defined. The buffer must stay valid for as long as the decoder is used. With
+ * `DECODER_NATIVE`, it must be aligned to four bytes.
+ *
+ * \param[in] decoder The structure to initialize
+ * \param[in] read Function to read from the stream
+ * \param[in] context Passed through to `read`
+ * \param[in] staging Buffer to read frames into
+ * \param[in] staging_length The length of `staging` in bytes
+ */
+void decoder_initialize_reader(decoder_t *decoder,
+                               size_t (*read)(void *context, void *buffer,
+                                              size_t offset, size_t length),
+                               void *context, void *staging,
+                               size_t staging_length);
+
+/**
+ * \brief How many bytes of codebooks a decoder needs for some number of strips
+ * \see decoder_set_arena()
+ */
+#define DECODER_ARENA_LENGTH(strips)                                           \
+  ((strips) * DECODER_MAX_ENTRIES *                                            \
+   (sizeof(decoder_v4_entry_t) + sizeof(decoder_v1_entry_t)))
+
+/**
+ * \brief Give a decoder storage for its codebooks
+ *
+ * With `DECODER_ARENA`, this must be called after initializing the decoder and
+ * before decoding any frames. Otherwise, it's optional, and it replaces the
+ * storage in the decoder. Either way, every strip starts over with empty
+ * codebooks.
+ *
+ * The arena must be `DECODER_ARENA_LENGTH(strips)` bytes long, and aligned for
+ * `decoder_pair_t`. It must stay valid for as long as the decoder is used.
+ * Frames with more than `strips` strips can't be decoded. They're reported as
+ * invalid data if `DECODER_VALIDATE` is defined. The player gets the number of
+ * strips from `mkindex`, and the test harness finds it by walking the frame
+ * headers first.
+ *
+ * \param[inout] decoder The decoder to modify
+ * \param[in] arena Where to keep the codebooks
+ * \param[in] strips The most strips any frame has, up to `DECODER_MAX_STRIPS`
+ */
+void decoder_set_arena(decoder_t *decoder, void *arena, size_t strips);
+
+/**
+ * \brief Set where a decoder writes its frames
+ *
+ * By default, frames are decoded into `decoder->framebuffer`. This function
+ * redirects them to a caller-supplied buffer instead, such as the screen
+ * itself. With `DECODER_ARENA`, the decoder doesn't have a framebuffer, so this
+ * must be called before decoding any frames, and `output` can't be `NULL`. The
+ * buffer isn't cleared, so it should start out black like the decoder's own.
+ * The buffer must be `DECODER_OUTPUT_WIDTH` pixels wide and
+ * `DECODER_OUTPUT_HEIGHT` pixels tall, with no padding between rows. It must
+ * also be aligned for `decoder_pair_t`.
+ *
+ * Inter-coded frames only write the blocks that changed, so the buffer must
+ * hold the previous frame when decoding continues. Switching targets between
+ * frames is the caller's responsibility in that regard.
+ *
+ * \param[inout] decoder The decoder to modify
+ * \param[in] output Where to write frames, or `NULL` for the internal buffer
+ */
+void decoder_set_output(decoder_t *decoder, uint16_t *output);
+
+/**
+ * \brief Convert CVID YUV to BGR555
+ *
+ * Note that `u` and `v` are signed. That's not specified in the format's
+ * documentation.
+ *
+ * If `DECODER_YUV_LUT` is defined, this uses lookup tables instead of doing the
+ * arithmetic. The result is the same either way. It's exposed so the test
+ * harness can check that.
+ */
+uint16_t decoder_yuv_to_bgr555(uint8_t y, int8_t u, int8_t v);
+
 /**
  * \brief Get a reference to a decoder's framebuffer
- * \return `decoder->framebuffer`
+ *
+ * The decoder's own framebuffer is cleared as the first frame is decoded, so
+ * it only has something meaningful in it after that.
+ *
+ * \return The buffer frames are currently decoded into
  */
 const uint16_t *decoder_get_framebuffer(const decoder_t *decoder);
 
+/**
+ * \brief Get how much of the framebuffer the frames being decoded cover
+ *
+ * This is always `DECODER_OUTPUT_WIDTH` by `DECODER_OUTPUT_HEIGHT`, unless
+ * `DECODER_ANY_SIZE` is defined. Then, it's the size of the last frame decoded
+ * after scaling, or of the whole framebuffer before any are. Rows are always
+ * `DECODER_OUTPUT_WIDTH` apart.
+ *
+ * \param[in] decoder The decoder to query
+ * \param[out] width Where to put the width in pixels
+ * \param[out] height Where to put the height in pixels
+ */
+void decoder_get_dimensions(const decoder_t *decoder, size_t *width,
+                            size_t *height);
+
+/**
+ * \brief Set a function to call after each strip is decoded
+ *
+ * The callback is passed the strip that was just decoded, with its coordinates
+ * made absolute. It's called from inside decoder_compute_frame(), so it gives
+ * the player a chance to do work while a frame is being decoded, like keeping
+ * time. By then, the strip's pixels are in the output, and the rows it wrote
+ * are marked in decoder_get_dirty_rows(). So, the player can present the strip
+ * before the rest of the frame is done.
+ *
+ * \param[inout] decoder The decoder to modify
+ * \param[in] callback Function to call, or `NULL` for none
+ * \param[in] context Passed through to the callback
+ */
+void decoder_set_strip_callback(decoder_t *decoder,
+                                void (*callback)(void *context,
+                                                 const decoder_strip_t *strip),
+                                void *context);
+
+#ifdef DECODER_STATS
+/**
+ * \brief Set the clock the decoder keeps time with
+ *
+ * The decoder has no way to tell time itself, so the player has to provide
+ * it. The clock is read at the start and end of every frame and chunk, so it
+ * should be cheap. It may wrap around.
+ *
+ * \param[inout] decoder The decoder to modify
+ * \param[in] clock Function returning the current time, or `NULL` for none
+ * \param[in] context Passed through to the clock
+ */
+void decoder_set_stats_clock(decoder_t *decoder,
+                             uint32_t (*clock)(void *context), void *context);
+
+/**
+ * \brief Get the counters for the last frame decoded
+ */
+const decoder_stats_t *decoder_get_frame_stats(const decoder_t *decoder);
+
+/**
+ * \brief Get the counters for every frame decoded since initialization
+ */
+const decoder_stats_t *decoder_get_total_stats(const decoder_t *decoder);
+#endif
+
+/**
+ * \brief Get which rows of blocks the last frame wrote to
+ *
+ * Entry `i` is set if any pixel in the `DECODER_BLOCK_LINES` lines of the
+ * framebuffer starting at `DECODER_BLOCK_LINES * i` was written by the last
+ * call to decoder_compute_frame(). Rows that aren't set still hold the
+ * contents of the frame before. This way, the player only has to present the
+ * parts of the frame that changed.
+ *
+ * \return An array of `DECODER_BLOCK_ROWS` flags
+ */
+const bool *decoder_get_dirty_rows(const decoder_t *decoder);
+
 /**
  * \brief Whether we can compute the next frame
  * \return If another frame exists after the last one computed
@@ -134,11 +521,63 @@ typedef enum decoder_status_t {
   ERROR_INTERNAL,
 } decoder_status_t;
 
+/**
+ * \brief Where a frame is in the stream, and how it's coded
+ *
+ * This is everything in a frame's header that's needed to find frames without
+ * decoding them. The `Makefile` generates a table of these for the video.
+ */
+typedef struct decoder_frame_info_t {
+  uint32_t offset;
+  uint32_t length;
+  uint16_t strips;
+  bool keyframe;
+} decoder_frame_info_t;
+
+/**
+ * \brief Read the header of the next frame without decoding it
+ * \param[in] decoder The decoder to read from
+ * \param[out] info Where to put the frame's information
+ * \return Whether the header was valid, and the error if not
+ */
+decoder_status_t decoder_peek_frame(const decoder_t *decoder,
+                                    decoder_frame_info_t *info);
+
+/**
+ * \brief Skip over the next frame without decoding it
+ *
+ * This only reads the frame's header. Remember that the frames after an
+ * inter-coded frame depend on it, so this leaves the decoder's state stale
+ * until the next keyframe.
+ *
+ * \return Whether the header was valid, and the error if not
+ */
+decoder_status_t decoder_skip_frame(decoder_t *decoder);
+
+/**
+ * \brief Continue decoding from a keyframe
+ *
+ * The next call to decoder_compute_frame() will decode the given frame. This
+ * relies on keyframes rebuilding every codebook entry they use and covering the
+ * whole screen, which is what encoders do in practice.
+ *
+ * That means nothing else has to be reset, so this is much cheaper than
+ * starting over with decoder_initialize(). The output buffer and the strip
+ * callback are kept as well.
+ *
+ * \param[inout] decoder The decoder to move
+ * \param[in] frame The keyframe to start at, usually from an index
+ * \return Whether the frame can be seeked to, and the error if not
+ */
+decoder_status_t decoder_seek_keyframe(decoder_t *decoder,
+                                       const decoder_frame_info_t *frame);
+
 /**
  * \brief Compute the next frame
  *
- * The result of the computation goes into the internal framebuffer. It can be
- * accessed with decoder_get_framebuffer(). Calling this method invalidates the
- * previous pointers gotten through decoder_get_framebuffer().
+ * The result of the computation goes into the output buffer, which is the
+ * internal framebuffer unless decoder_set_output() was used. It can be accessed
+ * with decoder_get_framebuffer(). Calling this method invalidates the previous
+ * pointers gotten through decoder_get_framebuffer().
  */
 decoder_status_t decoder_compute_frame(decoder_t *decoder);
@@ -0,0 +1,223 @@
+    ; Hand-written versions of the decoder's block kernels
+    ;
+    ; These are linked in place of the C versions in decoder.c when CDEFS has
+    ; DECODER_ASM. The C versions are the reference, and these have to write
+    ; exactly the same pixels.
+    ;
+    ; The test harness runs on the host, so it can't run these. To check them,
+    ; build the player with VIDEO_DEMO_BENCHMARK and VIDEO_DEMO_CHECKSUM as
+    ; well, and check what it prints with the harness's -v. The README has the
+    ; commands. Do that whenever these change.
+    ;
+    ; Both take their arguments on the stack, the same way startup.s calls
+    ; main. On entry, the first argument is at SP. On return, SP is one word
+    ; below where it was, and that word is the return value, which is unused
+    ; here. They save every register they use, so the caller doesn't have to
+    ; assume anything about which ones survive.
+    ;
+    ; Their frame is ten words, and the last one is left behind on return:
+    ;   SP+0 - SP+6   Saved R0 - R3, GP, FP, and LR
+    ;   SP+7          0xff, for masking loaded bytes
+    ;   SP+8          How many blocks are left
+    ;   SP+9          The return value
+    ;   SP+10 - SP+13 The arguments
+    ;
+    ; SP counts bytes, so the frame is 40 of them. ADD takes a five-bit signed
+    ; immediate, like it does on the LC-3, so SP is moved in several steps.
+    ;
+    ; The row stride doesn't fit in an offset, so it's kept in R3. A pointer to
+    ; the row being written is kept in LR, and stores to the row below it go
+    ; through GP once the codebook entry has been read. Bytes are masked with
+    ; 0xff after loading, so it doesn't matter whether LDB sign-extends.
+    ; The count of blocks left is kept in the frame, and the loops branch on
+    ; the ADD that decrements it, since STW leaves the condition codes alone.
+
+    .text
+
+    ; void decoder_kernel_v4_run(decoder_pair_t *block,
+    ;                            const decoder_v4_entry_t *codebook,
+    ;                            const unsigned char *vectors, size_t count)
+    ;
+    ; Each entry is two words, so the index is scaled by eight
+    .global decoder_kernel_v4_run
+decoder_kernel_v4_run:
+    ADD SP, SP, -16
+    ADD SP, SP, -16
+    ADD SP, SP, -8
+    STW R0, SP, 0
+    STW R1, SP, 1
+    STW R2, SP, 2
+    STW R3, SP, 3
+    STW GP, SP, 4
+    STW FP, SP, 5
+    STW LR, SP, 6
+
+    LDW R0, SP, 10
+    LDW R1, SP, 11
+    LDW R2, SP, 12
+    LDW R3, SP, 13
+    STW R3, SP, 8
+    PSEUDO.LOADCONSTW R3, 0xff
+    STW R3, SP, 7
+    ; DECODER_STRIDE pairs of pixels, in bytes
+    PSEUDO.LOADCONSTW R3, 640
+
+v4_block:
+    ; Vector 0 goes to (0,0) - (1,1)
+    LDB GP, R2, 0
+    LDW FP, SP, 7
+    AND GP, GP, FP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, R1
+    LDW FP, GP, 0
+    STW FP, R0, 0
+    LDW FP, GP, 1
+    ADD GP, R0, R3
+    STW FP, GP, 0
+
+    ; Vector 1 goes to (2,0) - (3,1)
+    LDB GP, R2, 1
+    LDW FP, SP, 7
+    AND GP, GP, FP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, R1
+    LDW FP, GP, 0
+    STW FP, R0, 1
+    LDW FP, GP, 1
+    ADD GP, R0, R3
+    STW FP, GP, 1
+
+    ; Move down to the third row
+    ADD LR, R0, R3
+    ADD LR, LR, R3
+
+    ; Vector 2 goes to (0,2) - (1,3)
+    LDB GP, R2, 2
+    LDW FP, SP, 7
+    AND GP, GP, FP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, R1
+    LDW FP, GP, 0
+    STW FP, LR, 0
+    LDW FP, GP, 1
+    ADD GP, LR, R3
+    STW FP, GP, 0
+
+    ; Vector 3 goes to (2,2) - (3,3)
+    LDB GP, R2, 3
+    LDW FP, SP, 7
+    AND GP, GP, FP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, R1
+    LDW FP, GP, 0
+    STW FP, LR, 1
+    LDW FP, GP, 1
+    ADD GP, LR, R3
+    STW FP, GP, 1
+
+    ; Next block, which is two pairs to the right
+    ADD R0, R0, 8
+    ADD R2, R2, 4
+    LDW FP, SP, 8
+    ADD FP, FP, -1
+    STW FP, SP, 8
+    BRp v4_block
+
+    LDW R0, SP, 0
+    LDW R1, SP, 1
+    LDW R2, SP, 2
+    LDW R3, SP, 3
+    LDW GP, SP, 4
+    LDW FP, SP, 5
+    LDW LR, SP, 6
+    ADD SP, SP, 12
+    ADD SP, SP, 12
+    ADD SP, SP, 12
+    RET
+
+    ; void decoder_kernel_v1_run(decoder_pair_t *block,
+    ;                            const decoder_v1_entry_t *codebook,
+    ;                            const unsigned char *vectors, size_t count)
+    ;
+    ; Each entry is four words, so the index is scaled by sixteen
+    .global decoder_kernel_v1_run
+decoder_kernel_v1_run:
+    ADD SP, SP, -16
+    ADD SP, SP, -16
+    ADD SP, SP, -8
+    STW R0, SP, 0
+    STW R1, SP, 1
+    STW R2, SP, 2
+    STW R3, SP, 3
+    STW GP, SP, 4
+    STW FP, SP, 5
+    STW LR, SP, 6
+
+    LDW R0, SP, 10
+    LDW R1, SP, 11
+    LDW R2, SP, 12
+    LDW R3, SP, 13
+    STW R3, SP, 8
+    PSEUDO.LOADCONSTW R3, 0xff
+    STW R3, SP, 7
+    ; DECODER_STRIDE pairs of pixels, in bytes
+    PSEUDO.LOADCONSTW R3, 640
+
+v1_block:
+    LDB GP, R2, 0
+    LDW FP, SP, 7
+    AND GP, GP, FP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, GP
+    ADD GP, GP, R1
+
+    ; c00 and c11 go on the first two rows
+    ADD LR, R0, R3
+    LDW FP, GP, 0
+    STW FP, R0, 0
+    STW FP, LR, 0
+    LDW FP, GP, 1
+    STW FP, R0, 1
+    STW FP, LR, 1
+
+    ; c22 and c33 go on the last two rows. We only have one register for the
+    ; rows, so c22 is loaded again for the last one.
+    ADD LR, LR, R3
+    LDW FP, GP, 2
+    STW FP, LR, 0
+    LDW FP, GP, 3
+    STW FP, LR, 1
+    ADD LR, LR, R3
+    STW FP, LR, 1
+    LDW FP, GP, 2
+    STW FP, LR, 0
+
+    ; Next block, which is two pairs to the right
+    ADD R0, R0, 8
+    ADD R2, R2, 1
+    LDW FP, SP, 8
+    ADD FP, FP, -1
+    STW FP, SP, 8
+    BRp v1_block
+
+    LDW R0, SP, 0
+    LDW R1, SP, 1
+    LDW R2, SP, 2
+    LDW R3, SP, 3
+    LDW GP, SP, 4
+    LDW FP, SP, 5
+    LDW LR, SP, 6
+    ADD SP, SP, 12
+    ADD SP, SP, 12
+    ADD SP, SP, 12
+    RET
@@ -12,26 +12,52 @@ void puts(const char *s) {
   }
 }
 
-#ifndef VIDEO_DEMO_BENCHMARK
+/**
+ * \brief Global decoder for the video
+ */
+decoder_t decoder;
 
-#ifndef VIDEO_DEMO_PRESENT_DELAY
 /**
- * \brief How many frames to wait between video frames
+ * \defgroup VIDEO_DEMO_SCREEN
+ * \brief Where the video goes on the screen
+ *
+ * The screen is always 320x240, but the video can be smaller if the decoder
+ * was built for another size. Then, it's centered, and the rest of the screen
+ * is left black. With `DECODER_UPSCALE`, it's the decoder's output that has to
+ * fit, so a 160x120 video fills the screen.
  *
- * Remember that the player is entirely open loop. Configure this value so you
- * get approximately 15fps on the output.
+ * @{
  */
-#define VIDEO_DEMO_PRESENT_DELAY 3
+#define VIDEO_DEMO_SCREEN_WIDTH 320
+#define VIDEO_DEMO_SCREEN_HEIGHT 240
+#if DECODER_OUTPUT_WIDTH > VIDEO_DEMO_SCREEN_WIDTH ||                          \
+    DECODER_OUTPUT_HEIGHT > VIDEO_DEMO_SCREEN_HEIGHT
+#error "The video doesn't fit on the screen"
 #endif
+/**
+ * \brief Which line of the screen the video starts on
+ */
+#define VIDEO_DEMO_ORIGIN_LINE                                                 \
+  ((VIDEO_DEMO_SCREEN_HEIGHT - DECODER_OUTPUT_HEIGHT) / 2)
+/**
+ * \brief How many pixels into the screen the video's top-left corner is
+ */
+#define VIDEO_DEMO_ORIGIN                                                      \
+  (VIDEO_DEMO_ORIGIN_LINE * VIDEO_DEMO_SCREEN_WIDTH +                          \
+   (VIDEO_DEMO_SCREEN_WIDTH - DECODER_OUTPUT_WIDTH) / 2)
+/** @} */
 
+#if !defined(VIDEO_DEMO_BENCHMARK) || defined(DECODER_STATS)
+
+#ifndef VIDEO_DEMO_REFRESH_LINES
 /**
- * \brief Hardware representation of DMA controller
+ * \brief How many lines `REG_VCOUNT` counts through per refresh
+ *
+ * This is the height of the screen plus the length of vblank. It should match
+ * `vblank_length` in `lc32sim.json`.
  */
-typedef struct dmactl_t {
-  uint32_t src;
-  uint32_t dst;
-  uint32_t ctl;
-} __attribute__((packed)) dmactl_t;
+#define VIDEO_DEMO_REFRESH_LINES (VIDEO_DEMO_SCREEN_HEIGHT + 68)
+#endif
 
 /**
  * \brief Spin until we're in the next VBlank
@@ -40,12 +66,288 @@ static void wait_for_vblank(void) {
   // Where to read the current line
   static volatile uint16_t *const REG_VCOUNT = (uint16_t *)0xf0000000;
   // Do the wait
-  while (*REG_VCOUNT >= DECODER_HEIGHT)
+  while (*REG_VCOUNT >= VIDEO_DEMO_SCREEN_HEIGHT)
     ;
-  while (*REG_VCOUNT < DECODER_HEIGHT)
+  while (*REG_VCOUNT < VIDEO_DEMO_SCREEN_HEIGHT)
     ;
 }
 
+/**
+ * \defgroup VIDEO_DEMO_CLOCK
+ * \brief Count vblanks while doing other work
+ *
+ * There are no interrupts, so we keep time by sampling `REG_VCOUNT` and adding
+ * up how far it moved. This has to be polled at least once per refresh, or
+ * we'll miss vblanks. The decoder does that for us after every strip.
+ *
+ * @{
+ */
+
+/**
+ * \brief How many vblanks have started since the clock was started
+ */
+static uint32_t clock_vblanks;
+/**
+ * \brief The line we saw when we last polled
+ */
+static uint16_t clock_line;
+/**
+ * \brief How many lines we are past the start of the last vblank
+ */
+static uint16_t clock_phase;
+
+/**
+ * \brief Update the clock
+ */
+static void clock_poll(void) {
+  // Where to read the current line
+  static volatile uint16_t *const REG_VCOUNT = (uint16_t *)0xf0000000;
+  // See how far we moved, accounting for wrapping around
+  uint16_t line = *REG_VCOUNT;
+  uint16_t delta = line >= clock_line
+                       ? line - clock_line
+                       : line + VIDEO_DEMO_REFRESH_LINES - clock_line;
+  clock_line = line;
+  // Count every vblank we passed
+  clock_phase += delta;
+  while (clock_phase >= VIDEO_DEMO_REFRESH_LINES) {
+    clock_phase -= VIDEO_DEMO_REFRESH_LINES;
+    clock_vblanks++;
+  }
+}
+
+/**
+ * \brief Start the clock at the beginning of the next vblank
+ */
+static void clock_start(void) {
+  wait_for_vblank();
+  clock_vblanks = 0;
+  clock_line = VIDEO_DEMO_SCREEN_HEIGHT;
+  clock_phase = 0;
+}
+
+/** @} */
+
+#endif
+
+#if !defined(VIDEO_DEMO_BENCHMARK) || defined(DECODER_STATS) ||               \
+    defined(VIDEO_DEMO_CHECKSUM)
+/**
+ * \brief Print an unsigned number to STDOUT
+ */
+static void put_uint(uint32_t n) {
+  char buf[11];
+  char *p = buf + sizeof(buf) - 1;
+  *p = '\0';
+  do {
+    *--p = '0' + n % 10;
+    n /= 10;
+  } while (n != 0);
+  puts(p);
+}
+#endif
+
+#ifdef DECODER_STATS
+/**
+ * \brief Clock for the decoder's statistics
+ *
+ * This counts lines since the clock was started. Polling it also keeps the
+ * clock up to date. Time spent in a single chunk is only right if the chunk
+ * takes less than a refresh, since that's all the clock can see between polls.
+ */
+static uint32_t stats_clock(void *context) {
+  (void)context;
+  clock_poll();
+  return clock_vblanks * VIDEO_DEMO_REFRESH_LINES + clock_phase;
+}
+
+/**
+ * \brief Print one of the counters from the statistics
+ * \param[in] name What the counter is
+ * \param[in] value The value of the counter
+ */
+static void report_stat(const char *name, uint32_t value) {
+  puts(name);
+  puts(": ");
+  put_uint(value);
+  puts("\n");
+}
+
+/**
+ * \brief Print a summary of what the decoder did
+ * \param[in] stats The counters to print
+ */
+static void report_stats(const decoder_stats_t *stats) {
+  report_stat("Frames", stats->frames);
+  report_stat("Bytes", stats->bytes);
+  report_stat("Codebook entries", stats->codebook_entries);
+  report_stat("V1 blocks", stats->v1_blocks);
+  report_stat("V4 blocks", stats->v4_blocks);
+  report_stat("Skipped blocks", stats->skipped_blocks);
+  report_stat("Lines decoding", stats->frame_time);
+  report_stat("Lines in codebooks", stats->chunk_time[DECODER_CHUNK_CODEBOOK]);
+  report_stat("Lines in intra vectors", stats->chunk_time[DECODER_CHUNK_INTRA]);
+  report_stat("Lines in inter vectors", stats->chunk_time[DECODER_CHUNK_INTER]);
+  report_stat("Lines in intra V1 vectors",
+              stats->chunk_time[DECODER_CHUNK_INTRA_V1]);
+}
+
+#ifdef VIDEO_DEMO_BENCHMARK
+/**
+ * \brief Print the counters for the frame that was just decoded
+ *
+ * This is one line per frame, which `video-demo-cost -c` fits its weights to.
+ *
+ * \param[in] stats The frame's counters
+ */
+static void report_frame_stats(const decoder_stats_t *stats) {
+  puts("Frame ");
+  put_uint(decoder_get_total_stats(&decoder)->frames - 1);
+  puts(": ");
+  put_uint(stats->bytes);
+  puts(" bytes, ");
+  put_uint(stats->codebook_entries);
+  puts(" entries, ");
+  put_uint(stats->v1_blocks);
+  puts(" V1, ");
+  put_uint(stats->v4_blocks);
+  puts(" V4, ");
+  put_uint(stats->skipped_blocks);
+  puts(" skipped, ");
+  put_uint(stats->frame_time);
+  puts(" lines\n");
+}
+#endif
+#endif
+
+#ifdef VIDEO_DEMO_CHECKSUM
+#ifndef VIDEO_DEMO_BENCHMARK
+#error "VIDEO_DEMO_CHECKSUM needs VIDEO_DEMO_BENCHMARK"
+#endif
+#ifdef DECODER_STATS
+#error "VIDEO_DEMO_CHECKSUM can't print statistics along with the checksums"
+#endif
+
+/**
+ * \defgroup VIDEO_DEMO_CHECKSUM
+ * \brief Print a checksum for every frame, like the test harness's `-c`
+ *
+ * The harness can check what we print with `-v`. That way, builds it can't
+ * make itself, like ones with `DECODER_ASM`, can still be checked against it.
+ *
+ * Every row of blocks is hashed the same way hash_block_row() in `test.c` does
+ * it. That's 64-bit FNV-1a, over words of four pixels, without scaling. We
+ * don't link a runtime library for 64-bit multiplication, so the hash is kept
+ * in two halves.
+ *
+ * @{
+ */
+
+/**
+ * \brief Multiply a 64-bit hash by the FNV prime, which is `2^40 + 0x1b3`
+ * \param[inout] hi The high half of the hash
+ * \param[inout] lo The low half of the hash
+ */
+static void checksum_multiply(uint32_t *hi, uint32_t *lo) {
+  const uint32_t l = *lo;
+  // The high half of l * 0x1b3, done in pieces of 16 bits so nothing overflows
+  const uint32_t carry =
+      ((l >> 16) * 0x1b3 + (((l & 0xffff) * 0x1b3) >> 16)) >> 16;
+  *hi = *hi * 0x1b3 + carry + (l << 8);
+  *lo = l * 0x1b3;
+}
+
+/**
+ * \brief Hash one row of blocks of a frame
+ * \param[in] frame The frame, with rows `DECODER_OUTPUT_WIDTH` apart
+ * \param[in] row Which row of blocks to hash
+ * \param[in] width How wide the frame is before scaling
+ * \return The hash of the row, folded to 32 bits
+ */
+static uint32_t checksum_row(const uint16_t *frame, size_t row, size_t width) {
+  uint32_t hi = 0xcbf29ce4;
+  uint32_t lo = 0x84222325;
+  for (size_t line = 4 * row; line < 4 * row + 4; line++) {
+    // Take the top-left pixel of every square when scaling
+    const uint16_t *p = frame + DECODER_SCALE * line * DECODER_OUTPUT_WIDTH;
+    for (size_t x = 0; x < DECODER_SCALE * width; x += 4 * DECODER_SCALE) {
+      lo ^= p[x] | (uint32_t)p[x + DECODER_SCALE] << 16;
+      hi ^= p[x + 2 * DECODER_SCALE] | (uint32_t)p[x + 3 * DECODER_SCALE] << 16;
+      checksum_multiply(&hi, &lo);
+    }
+  }
+  return hi ^ lo;
+}
+
+/**
+ * \brief Print a number to STDOUT as eight hex digits
+ */
+static void put_hex(uint32_t n) {
+  char buf[9];
+  for (size_t i = 8; i != 0; i--) {
+    buf[i - 1] = "0123456789abcdef"[n & 0xf];
+    n >>= 4;
+  }
+  buf[8] = '\0';
+  puts(buf);
+}
+
+/**
+ * \brief Print the checksum line for the frame the decoder just decoded
+ * \param[in] number Which frame of the video it is
+ * \param[in] frame Where the decoder put it
+ */
+static void report_checksum(uint32_t number, const uint16_t *frame) {
+  size_t width, height;
+  decoder_get_dimensions(&decoder, &width, &height);
+  width /= DECODER_SCALE;
+  height /= DECODER_SCALE;
+  put_uint(number);
+  for (size_t row = 0; row < height / 4; row++) {
+    puts(" ");
+    put_hex(checksum_row(frame, row, width));
+  }
+  puts("\n");
+}
+
+/** @} */
+#endif
+
+#ifndef VIDEO_DEMO_BENCHMARK
+
+#ifndef VIDEO_DEMO_FRAME_PERIOD
+/**
+ * \brief How many vblanks each video frame is shown for
+ *
+ * The display runs at 60Hz, so the default gives 15fps. The player presents
+ * frames on this schedule regardless of how long they take to decode.
+ */
+#define VIDEO_DEMO_FRAME_PERIOD 4
+#endif
+
+#ifndef VIDEO_DEMO_SEEK_DELAY
+/**
+ * \brief How many vblanks L or R has to be held before it repeats
+ */
+#define VIDEO_DEMO_SEEK_DELAY 15
+#endif
+
+#ifndef VIDEO_DEMO_SEEK_RATE
+/**
+ * \brief How many keyframes to move per vblank while L or R is held
+ */
+#define VIDEO_DEMO_SEEK_RATE 2
+#endif
+
+/**
+ * \brief Hardware representation of DMA controller
+ */
+typedef struct dmactl_t {
+  uint32_t src;
+  uint32_t dst;
+  uint32_t ctl;
+} __attribute__((packed)) dmactl_t;
+
 /**
  * \brief Return whether the start button is pressed on this frame
  */
@@ -72,64 +374,766 @@ static bool start_newly_pressed(void) {
 
 /**
  * \brief If the start button is just pressed, spin until it is pressed again
+ * \return Whether we paused
  */
-static void handle_pause(void) {
+static bool handle_pause(void) {
   if (start_newly_pressed()) {
     while (!start_newly_pressed())
       ;
+    return true;
   }
+  return false;
 }
 
-#endif
+/**
+ * \brief Return which way the shoulder buttons are seeking on this frame
+ * \return `1` for R, `-1` for L, or `0` for neither or both
+ */
+static int seek_direction(void) {
+  // Where to read key data
+  static volatile uint16_t *const REG_KEYINPUT = (uint16_t *)0xf0000002;
+  // Return
+  uint16_t keys = *REG_KEYINPUT;
+  return ((keys & (1 << 8)) == 0) - ((keys & (1 << 9)) == 0);
+}
 
 /**
- * \brief Global decoder for the video
+ * \brief Tell the user if a frame was presented late
+ * \param[in] late How many vblanks late the frame was
  */
-decoder_t decoder;
+static void report_behind(uint32_t late) {
+  if (late != 0) {
+    puts("Behind by ");
+    put_uint(late);
+    puts(" vblanks\n");
+  }
+}
 
-int main(void) {
+/**
+ * \defgroup VIDEO_DEMO_POSITION
+ * \brief Where we are in the video, in terms of its index
+ * @{
+ */
 
-#ifndef VIDEO_DEMO_BENCHMARK
-  // Relevant MMIO registers
-  static volatile dmactl_t *const REG_DMACTL = (dmactl_t *)0xf000000c;
-  static volatile uint16_t *const FRAMEBUFFER = (uint16_t *)0xfc000000;
+/**
+ * \brief The number of the next frame to decode
+ */
+static uint32_t position_frame;
+/**
+ * \brief The first entry of `video_keyframes` at or after `position_frame`
+ *
+ * This is `video_keyframes_len` if there are no keyframes left.
+ */
+static uint32_t position_next_keyframe;
+/**
+ * \brief The entry of `video_keyframes` that started what we last decoded
+ *
+ * After moving to a keyframe, this is that keyframe, even though it hasn't
+ * been decoded yet.
+ */
+static uint32_t position_keyframe;
+
+/**
+ * \brief Note that the next frame was decoded or skipped
+ */
+static void position_advance(void) {
+  if (position_next_keyframe != video_keyframes_len &&
+      video_keyframes[position_next_keyframe] == position_frame)
+    position_keyframe = position_next_keyframe++;
+  position_frame++;
+}
+
+/**
+ * \brief Note that we moved to a keyframe
+ * \param[in] keyframe The entry of `video_keyframes` we moved to
+ */
+static void position_seek(uint32_t keyframe) {
+  position_frame = video_keyframes[keyframe];
+  position_next_keyframe = keyframe;
+  position_keyframe = keyframe;
+}
+
+/** @} */
+
+/**
+ * \defgroup VIDEO_DEMO_SEEK
+ * \brief Move between keyframes with the shoulder buttons
+ *
+ * Pressing R or L moves to the next or previous keyframe. Holding one down
+ * keeps moving, `VIDEO_DEMO_SEEK_RATE` keyframes per vblank, after a short
+ * delay. Only the keyframe we land on is decoded. Everything in between is
+ * skipped using the index.
+ *
+ * Seeks are requested here when the buttons are polled. The player carries
+ * them out before it decodes the next frame.
+ *
+ * @{
+ */
+
+/**
+ * \brief Whether a seek is waiting to be carried out
+ */
+static bool seek_pending;
+/**
+ * \brief The entry of `video_keyframes` to seek to
+ */
+static uint32_t seek_target;
+/**
+ * \brief Which way we were seeking the last time we polled
+ */
+static int seek_held;
+/**
+ * \brief The vblank we last moved at while the button was held
+ *
+ * When the button is first pressed, this is set into the future to delay the
+ * repeat.
+ */
+static uint32_t seek_held_moved;
+
+/**
+ * \brief Check the shoulder buttons, requesting a seek if needed
+ *
+ * Like pausing, this should be checked once per vblank.
+ */
+static void seek_poll(void) {
+  int dir = seek_direction();
+  if (dir == 0) {
+    seek_held = 0;
+    return;
+  }
+
+  // Figure out how many keyframes to move. A fresh press moves one. Holding
+  // moves with every vblank after the delay.
+  uint32_t steps;
+  if (dir != seek_held) {
+    seek_held = dir;
+    seek_held_moved = clock_vblanks + VIDEO_DEMO_SEEK_DELAY;
+    steps = 1;
+  } else if (clock_vblanks > seek_held_moved) {
+    steps = (clock_vblanks - seek_held_moved) * VIDEO_DEMO_SEEK_RATE;
+    seek_held_moved = clock_vblanks;
+  } else {
+    return;
+  }
+
+  // Move from wherever we were already going. Otherwise, move relative to the
+  // keyframe that started what we last decoded, or the one we just moved to.
+  uint32_t from = seek_pending ? seek_target : position_keyframe;
+  uint32_t to;
+  if (dir > 0) {
+    // Don't go past the last keyframe
+    to = steps < video_keyframes_len - from ? from + steps
+                                            : video_keyframes_len - 1;
+    if (to == from)
+      return;
+  } else {
+    to = steps < from ? from - steps : 0;
+  }
+  seek_target = to;
+  seek_pending = true;
+}
+
+/** @} */
+
+/**
+ * \defgroup VIDEO_DEMO_SCHEDULE
+ * \brief Decide when frames go on screen
+ *
+ * The first frame goes up as soon as it's ready. Every frame after that is due
+ * a fixed number of vblanks after the one before it. If we're behind, we don't
+ * push the schedule back. We present the next frames as soon as they're ready
+ * until we catch up.
+ *
+ * @{
+ */
+
+/**
+ * \brief The vblank the next frame is due at
+ */
+static uint32_t schedule_deadline;
+
+/**
+ * \brief Handle the buttons, checking at most once per vblank
+ *
+ * If we pause, the schedule is reset so playback resumes where it left off.
+ * The clock restarts too, so anything being held is treated as a new press.
+ */
+static void schedule_poll_buttons(void) {
+  static uint32_t seen = UINT32_MAX;
+  if (clock_vblanks == seen)
+    return;
+  seen = clock_vblanks;
+  if (handle_pause()) {
+    clock_start();
+    seen = 0;
+    schedule_deadline = 0;
+    seek_held = 0;
+  }
+  seek_poll();
+}
+
+/**
+ * \brief Whether the next frame is due
+ */
+static bool schedule_due(void) { return clock_vblanks >= schedule_deadline; }
+
+/**
+ * \brief Spin until the next frame is due, handling the buttons while we do
+ *
+ * This returns early if a seek is requested, since the frame we were waiting
+ * on won't be shown.
+ */
+static void schedule_wait(void) {
+  do {
+    clock_poll();
+    schedule_poll_buttons();
+  } while (!schedule_due() && !seek_pending);
+}
+
+/**
+ * \brief How many vblanks past its deadline the next frame is
+ *
+ * This is only meaningful once the frame is due. It should be taken when the
+ * frame starts going to the screen, since that's when it's seen.
+ */
+static uint32_t schedule_lateness(void) {
+  return clock_vblanks - schedule_deadline;
+}
+
+/**
+ * \brief Note that the next frame was presented, and schedule the one after
+ * \param[in] late How late the frame was, from schedule_lateness()
+ */
+static void schedule_presented(uint32_t late) {
+  report_behind(late);
+  schedule_deadline += VIDEO_DEMO_FRAME_PERIOD;
+}
+
+/** @} */
+
+/**
+ * \defgroup VIDEO_DEMO_CATCH_UP
+ * \brief Drop frames when we fall too far behind
+ *
+ * If the next frame is already more than a frame late, decoding it only puts
+ * us further behind. Instead, we skip ahead to the next keyframe, reading just
+ * the headers of the frames we drop. The schedule moves on as if they had been
+ * shown, so playback keeps to the wall clock instead of slowing down.
+ *
+ * This only happens when no decoded frames are waiting, since those have
+ * already been paid for.
+ *
+ * @{
+ */
+
+/**
+ * \brief Tell the user that frames were dropped
+ * \param[in] dropped How many frames were dropped
+ */
+static void report_dropped(uint32_t dropped) {
+  puts("Dropped ");
+  put_uint(dropped);
+  puts(" frames\n");
+}
+
+/**
+ * \brief Skip to the next keyframe if we're too far behind
+ * \return The result of skipping, which is `SUCCESS` if we didn't have to
+ */
+static decoder_status_t catch_up(void) {
+  if (clock_vblanks <= schedule_deadline + VIDEO_DEMO_FRAME_PERIOD)
+    return SUCCESS;
+
+  // Find the next keyframe. If there isn't one, we have to decode everything
+  // that's left. If we're already at one, there's nothing to drop.
+  if (position_next_keyframe == video_keyframes_len)
+    return SUCCESS;
+  uint32_t target = video_keyframes[position_next_keyframe];
+  if (target == position_frame)
+    return SUCCESS;
+
+  // Skip the frames before it
+  uint32_t dropped = target - position_frame;
+  while (position_frame != target) {
+    decoder_status_t r = decoder_skip_frame(&decoder);
+    if (r != SUCCESS)
+      return r;
+    position_advance();
+  }
+  // We've landed on it as if we'd seeked there
+  position_seek(position_next_keyframe);
+  schedule_deadline += dropped * VIDEO_DEMO_FRAME_PERIOD;
+  report_dropped(dropped);
+  return SUCCESS;
+}
+
+/** @} */
+
+#ifndef VIDEO_DEMO_DIRECT
+
+#ifndef VIDEO_DEMO_RING_DEPTH
+/**
+ * \brief How many decoded frames we can have waiting to be presented
+ *
+ * With more than one, the decoder can run ahead during cheap frames. That
+ * way, an expensive frame like a keyframe can be absorbed without missing a
+ * deadline. Each frame costs `2 * DECODER_OUTPUT_PIXELS` bytes.
+ */
+#define VIDEO_DEMO_RING_DEPTH 1
 #endif
 
-  // Initialize the decoder
-  decoder_initialize(&decoder, video_cvid, video_cvid_len);
+/**
+ * \brief Copy rows of blocks from one frame to another
+ *
+ * Consecutive rows are merged into a single span. We still have to do each
+ * span in multiple passes since we can only transfer 16 bits at a time. If the
+ * destination is wider than the frame, like the screen can be, each line of
+ * pixels is its own transfer instead.
+ *
+ * \param[out] dst Where to copy the frame's top-left pixel to
+ * \param[in] dst_width How many pixels apart the destination's rows are
+ * \param[in] src Frame to copy from
+ * \param[in] rows Which of the `DECODER_BLOCK_ROWS` rows to copy
+ */
+static void dma_rows(volatile uint16_t *dst, size_t dst_width,
+                     const uint16_t *src, const bool *rows) {
+  // Where the DMA controller is
+  static volatile dmactl_t *const REG_DMACTL = (dmactl_t *)0xf000000c;
 
-  // Continually decode frames
-  while (decoder_has_next_frame(&decoder)) {
-    // Decode the frame and handle the result
-    decoder_status_t r = decoder_compute_frame(&decoder);
-    if (r != SUCCESS) {
-      puts("Error\n");
-      return 1;
+  size_t row = 0;
+  while (row < DECODER_BLOCK_ROWS) {
+    // Skip rows that we don't need
+    if (!rows[row]) {
+      row++;
+      continue;
     }
+    // Find the end of this span
+    size_t end = row;
+    while (end < DECODER_BLOCK_ROWS && rows[end])
+      end++;
 
-#ifndef VIDEO_DEMO_BENCHMARK
-    // Wait for VBlank. Skip frames as needed. Also handle pause.
-    for (size_t i = 0; i < VIDEO_DEMO_PRESENT_DELAY; i++) {
-      wait_for_vblank();
-      handle_pause();
+    // Transfer the span one line at a time if its lines aren't contiguous
+    if (dst_width != DECODER_OUTPUT_WIDTH) {
+      for (size_t line = DECODER_BLOCK_LINES * row;
+           line < DECODER_BLOCK_LINES * end; line++) {
+        REG_DMACTL->src = (intptr_t)(src + line * DECODER_OUTPUT_WIDTH);
+        REG_DMACTL->dst = (intptr_t)(dst + line * dst_width);
+        REG_DMACTL->ctl = 0x80000000 | DECODER_OUTPUT_WIDTH;
+      }
+      row = end;
+      continue;
     }
 
-    // Blit the framebuffer to the screen
-    // We have to do this in multiple passes since we can only transfer 16 bits
-    // at a time.
-    size_t togo = DECODER_PIXELS;
-    size_t done = 0;
+    // Transfer the span
+    size_t togo = (end - row) * DECODER_BLOCK_LINES * DECODER_OUTPUT_WIDTH;
+    size_t done = row * DECODER_BLOCK_LINES * DECODER_OUTPUT_WIDTH;
     while (togo != 0) {
       // Compute how much to add
       size_t toadd = togo > 0xffff ? 0xffff : togo;
       // Transfer
-      REG_DMACTL->src = (intptr_t)(decoder_get_framebuffer(&decoder) + done);
-      REG_DMACTL->dst = (intptr_t)(FRAMEBUFFER + done);
+      REG_DMACTL->src = (intptr_t)(src + done);
+      REG_DMACTL->dst = (intptr_t)(dst + done);
       REG_DMACTL->ctl = 0x80000000 | toadd;
       // Update amount to go
       togo -= toadd;
       done += toadd;
     }
+
+    // Next span
+    row = end;
+  }
+}
+
+/**
+ * \defgroup VIDEO_DEMO_STREAM
+ * \brief Present a late frame while it's still being decoded
+ *
+ * If the frame being decoded is already due, and no other frame is waiting to
+ * go first, there's no point holding it back until it's done. Instead, each
+ * strip's rows are copied to the screen once the strip is decoded and the
+ * raster has passed them. That way, the DMA for most of the frame overlaps with
+ * decoding the strips below, and rows never change while they're being shown.
+ * Whatever is left when the frame is done is copied right away, just like a
+ * frame that was presented whole.
+ *
+ * @{
+ */
+
+/**
+ * \brief Which rows of the frame being decoded still have to be presented
+ */
+static bool stream_rows[DECODER_BLOCK_ROWS];
+/**
+ * \brief Whether the frame being decoded has started going to the screen
+ */
+static bool stream_started;
+/**
+ * \brief How late the frame being decoded was when it started going out
+ */
+static uint32_t stream_late;
+
+/**
+ * \brief Get ready to present a new frame as it's decoded
+ */
+static void stream_reset(void) {
+  for (size_t i = 0; i < DECODER_BLOCK_ROWS; i++)
+    stream_rows[i] = false;
+  stream_started = false;
+}
+
+/**
+ * \brief Note which rows a strip wrote, now that it's decoded
+ * \param[in] strip The strip from the decoder's callback
+ */
+static void stream_add(const decoder_strip_t *strip) {
+  const bool *dirty = decoder_get_dirty_rows(&decoder);
+  for (size_t row = strip->y0 / 4; row < strip->y1 / 4; row++)
+    stream_rows[row] |= dirty[row];
+}
+
+/**
+ * \brief Copy rows that are ready from the frame being decoded to the screen
+ * \param[in] frame The frame being decoded
+ * \param[in] all Whether to copy rows the raster hasn't passed yet too
+ */
+static void stream_present(const uint16_t *frame, bool all) {
+  // Where to read the current line
+  static volatile uint16_t *const REG_VCOUNT = (uint16_t *)0xf0000000;
+  // The screen
+  static volatile uint16_t *const FRAMEBUFFER = (uint16_t *)0xfc000000;
+
+  // The frame is seen from the first time we get here, so that's how late it is
+  if (!stream_started) {
+    stream_late = schedule_lateness();
+    stream_started = true;
+  }
+
+  // Rows above the raster won't be shown again until the next refresh. During
+  // vblank, that's all of them.
+  const uint16_t line = *REG_VCOUNT;
+  bool rows[DECODER_BLOCK_ROWS];
+  for (size_t row = 0; row < DECODER_BLOCK_ROWS; row++) {
+    const size_t end = VIDEO_DEMO_ORIGIN_LINE + (row + 1) * DECODER_BLOCK_LINES;
+    rows[row] = stream_rows[row] && (all || line >= end);
+    stream_rows[row] = stream_rows[row] && !rows[row];
+  }
+  dma_rows(FRAMEBUFFER + VIDEO_DEMO_ORIGIN, VIDEO_DEMO_SCREEN_WIDTH, frame,
+           rows);
+}
+
+/** @} */
+
+/**
+ * \defgroup VIDEO_DEMO_RING
+ * \brief Frames that have been decoded but not presented yet
+ *
+ * The ring is filled in order, and presented from oldest to newest.
+ *
+ * Inter-coded frames only write what changed, so a frame has to be decoded on
+ * top of the one before it. Before decoding into a slot, we bring it up to
+ * date by copying over just the rows that were written since it was last
+ * used.
+ *
+ * @{
+ */
+
+/**
+ * \brief Storage for the frames
+ */
+static uint16_t ring_frames[VIDEO_DEMO_RING_DEPTH][DECODER_OUTPUT_PIXELS]
+    __attribute__((aligned(sizeof(decoder_pair_t))));
+/**
+ * \brief Which rows of each frame differ from the frame before it
+ */
+static bool ring_changed[VIDEO_DEMO_RING_DEPTH][DECODER_BLOCK_ROWS];
+/**
+ * \brief Which rows of each frame differ from the newest frame
+ */
+static bool ring_stale[VIDEO_DEMO_RING_DEPTH][DECODER_BLOCK_ROWS];
+/**
+ * \brief The oldest decoded frame
+ */
+static size_t ring_head;
+/**
+ * \brief Where the next frame will be decoded into
+ */
+static size_t ring_tail;
+/**
+ * \brief How many frames are waiting to be presented
+ */
+static size_t ring_count;
+
+/**
+ * \brief Get the slot after the given one
+ */
+static size_t ring_next(size_t slot) {
+  return slot + 1 == VIDEO_DEMO_RING_DEPTH ? 0 : slot + 1;
+}
+
+/**
+ * \brief Whether the frame being decoded should be presented as it goes
+ *
+ * That's when it's due, and no frames are waiting to be presented before it.
+ * Once this is true for a frame, it stays true until the frame is done.
+ */
+static bool ring_streaming(void) { return ring_count == 0 && schedule_due(); }
+
+/**
+ * \brief Decode the next frame into the ring
+ *
+ * There must be space in the ring.
+ *
+ * \return The result of decoding the frame
+ */
+static decoder_status_t ring_decode(void) {
+  size_t slot = ring_tail;
+  size_t newest = slot == 0 ? VIDEO_DEMO_RING_DEPTH - 1 : slot - 1;
+
+  // Bring the slot up to date, then decode on top of it. Nothing of it is on
+  // the screen yet.
+  dma_rows(ring_frames[slot], DECODER_OUTPUT_WIDTH, ring_frames[newest],
+           ring_stale[slot]);
+  stream_reset();
+  decoder_set_output(&decoder, ring_frames[slot]);
+  decoder_status_t r = decoder_compute_frame(&decoder);
+  if (r != SUCCESS)
+    return r;
+  position_advance();
+
+  // Everything this frame wrote is now stale in the other slots
+  const bool *dirty = decoder_get_dirty_rows(&decoder);
+  for (size_t i = 0; i < DECODER_BLOCK_ROWS; i++) {
+    for (size_t j = 0; j < VIDEO_DEMO_RING_DEPTH; j++)
+      ring_stale[j][i] |= dirty[i];
+    ring_stale[slot][i] = false;
+    ring_changed[slot][i] = dirty[i];
+  }
+
+  // If the frame is late, finish presenting it instead of waiting in the ring
+  if (ring_streaming()) {
+    stream_present(ring_frames[slot], true);
+    ring_tail = ring_next(slot);
+    ring_head = ring_tail;
+    schedule_presented(stream_late);
+    return SUCCESS;
+  }
+
+  // Done
+  ring_tail = ring_next(slot);
+  ring_count++;
+  return SUCCESS;
+}
+
+/**
+ * \brief Present the oldest frame in the ring if it's due
+ *
+ * The screen always has the frame before it, so we only have to blit the rows
+ * that changed.
+ */
+static void ring_present_if_due(void) {
+  // The screen
+  static volatile uint16_t *const FRAMEBUFFER = (uint16_t *)0xfc000000;
+
+  if (ring_count == 0 || !schedule_due())
+    return;
+  dma_rows(FRAMEBUFFER + VIDEO_DEMO_ORIGIN, VIDEO_DEMO_SCREEN_WIDTH,
+           ring_frames[ring_head], ring_changed[ring_head]);
+  ring_head = ring_next(ring_head);
+  ring_count--;
+  schedule_presented(schedule_lateness());
+}
+
+/**
+ * \brief Throw away every frame waiting to be presented
+ *
+ * The next frame decoded must be a keyframe, since the slot it goes into may
+ * not be up to date.
+ */
+static void ring_discard(void) {
+  ring_head = ring_tail;
+  ring_count = 0;
+}
+
+/** @} */
+
+#elif defined(VIDEO_DEMO_RING_DEPTH)
+#error "VIDEO_DEMO_DIRECT decodes onto the screen, so it can't use a ring"
+#endif
+
+/**
+ * \brief Carry out a requested seek, if there is one
+ *
+ * Frames that were decoded but not presented yet are thrown away. The keyframe
+ * we land on is given a frame period to decode, and the schedule continues
+ * from there.
+ *
+ * \return The result of seeking, which is `SUCCESS` if we didn't have to
+ */
+static decoder_status_t seek_apply(void) {
+  if (!seek_pending)
+    return SUCCESS;
+  seek_pending = false;
+
+  // Move the decoder. The keyframe overwrites everything, so we don't have to
+  // reset anything else.
+  decoder_status_t r = decoder_seek_keyframe(
+      &decoder, &video_index[video_keyframes[seek_target]]);
+  if (r != SUCCESS)
+    return r;
+  position_seek(seek_target);
+#ifndef VIDEO_DEMO_DIRECT
+  ring_discard();
+#endif
+
+  // Reschedule
+  schedule_deadline = clock_vblanks + VIDEO_DEMO_FRAME_PERIOD;
+  return SUCCESS;
+}
+
+/**
+ * \brief Decoder callback to do work while decoding
+ *
+ * This keeps the clock up to date. If we're decoding ahead, it also presents
+ * frames that come due while we're busy. If the frame being decoded is due
+ * itself, it presents what's done of it so far.
+ */
+static void player_strip_callback(void *context, const decoder_strip_t *strip) {
+  (void)context;
+  clock_poll();
+#ifndef VIDEO_DEMO_DIRECT
+  ring_present_if_due();
+  stream_add(strip);
+  if (ring_streaming())
+    stream_present(ring_frames[ring_tail], false);
+#else
+  (void)strip;
+#endif
+}
+
+#endif
+
+int main(void) {
+
+  // Initialize the decoder, with only as many codebooks as the video needs
+  decoder_initialize(&decoder, video_cvid, video_cvid_len);
+  decoder_set_arena(&decoder, video_arena, video_max_strips);
+
+#ifdef DECODER_STATS
+  // Keep time for the statistics
+  decoder_set_stats_clock(&decoder, stats_clock, NULL);
+#endif
+
+#if defined(VIDEO_DEMO_BENCHMARK)
+  // Just decode as fast as we can. The decoder doesn't have a framebuffer of
+  // its own, so we still need somewhere to put the frames.
+  static uint16_t frame[DECODER_OUTPUT_PIXELS]
+      __attribute__((aligned(sizeof(decoder_pair_t))));
+  decoder_set_output(&decoder, frame);
+#ifdef DECODER_STATS
+  uint32_t slowest_frame = 0;
+  uint32_t slowest_time = 0;
+  clock_start();
+#endif
+#ifdef VIDEO_DEMO_CHECKSUM
+  uint32_t frame_number = 0;
+#endif
+  while (decoder_has_next_frame(&decoder)) {
+    decoder_status_t r = decoder_compute_frame(&decoder);
+    if (r != SUCCESS) {
+      puts("Error\n");
+      return 1;
+    }
+#ifdef VIDEO_DEMO_CHECKSUM
+    report_checksum(frame_number++, frame);
+#endif
+#ifdef DECODER_STATS
+    // Report the frame, and remember the worst one
+    const decoder_stats_t *stats = decoder_get_frame_stats(&decoder);
+    report_frame_stats(stats);
+    if (stats->frame_time > slowest_time) {
+      slowest_frame = decoder_get_total_stats(&decoder)->frames - 1;
+      slowest_time = stats->frame_time;
+    }
+#endif
+  }
+#ifdef DECODER_STATS
+  report_stat("Slowest frame", slowest_frame);
+  report_stat("Lines in slowest frame", slowest_time);
+#endif
+
+#elif defined(VIDEO_DEMO_DIRECT)
+  // Decode straight onto the screen. The simulator only has the one
+  // framebuffer, so this is single-buffered. We trade some tearing for not
+  // having to copy every frame. The decoder's rows have to line up with the
+  // screen's, but the video can still be letterboxed.
+#if DECODER_OUTPUT_WIDTH != VIDEO_DEMO_SCREEN_WIDTH
+#error "VIDEO_DEMO_DIRECT needs the video to be as wide as the screen"
 #endif
+  static volatile uint16_t *const FRAMEBUFFER = (uint16_t *)0xfc000000;
+  decoder_set_output(&decoder, (uint16_t *)FRAMEBUFFER + VIDEO_DEMO_ORIGIN);
+  decoder_set_strip_callback(&decoder, player_strip_callback, NULL);
+
+  clock_start();
+  while (decoder_has_next_frame(&decoder)) {
+    // Decoding is presenting, so wait for the deadline first. If we're too
+    // far past it, skip ahead instead.
+    clock_poll();
+    schedule_poll_buttons();
+    decoder_status_t r = seek_apply();
+    if (r == SUCCESS)
+      r = catch_up();
+    if (r != SUCCESS) {
+      puts("Error\n");
+      return 1;
+    }
+    schedule_wait();
+    if (seek_pending)
+      continue;
+    // The frame goes to the screen as it's decoded, so it's as late as it is
+    // now. The next deadline only moves once it's done.
+    const uint32_t late = schedule_lateness();
+    r = decoder_compute_frame(&decoder);
+    if (r != SUCCESS) {
+      puts("Error\n");
+      return 1;
+    }
+    position_advance();
+    schedule_presented(late);
+  }
+
+#else
+  // Decode into the ring, and present from it whenever a frame is due
+  decoder_set_strip_callback(&decoder, player_strip_callback, NULL);
+
+  clock_start();
+  while (decoder_has_next_frame(&decoder) || ring_count != 0) {
+    // Seek first, since it throws out whatever we'd present next
+    clock_poll();
+    schedule_poll_buttons();
+    decoder_status_t r = seek_apply();
+    // Decode ahead if we have space. Otherwise, there's nothing to do until
+    // the next frame is due.
+    if (r == SUCCESS) {
+      if (ring_count < VIDEO_DEMO_RING_DEPTH &&
+          decoder_has_next_frame(&decoder)) {
+        if (ring_count == 0)
+          r = catch_up();
+        if (r == SUCCESS)
+          r = ring_decode();
+      } else {
+        schedule_wait();
+      }
+    }
+    if (r != SUCCESS) {
+      puts("Error\n");
+      return 1;
+    }
+    ring_present_if_due();
   }
+#endif
+
+#ifdef DECODER_STATS
+  // Summarize
+  report_stats(decoder_get_total_stats(&decoder));
+#endif
 }
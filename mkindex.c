@@ -0,0 +1,122 @@
+/**
+ * \file mkindex.c
+ * \brief Generate a frame index for a video
+ *
+ * This runs on the host as part of the build. It walks the frame headers of a
+ * raw CVID file with the decoder, and it writes C source for the index declared
+ * in `video.h` to STDOUT. The `Makefile` writes that to `video-index.c`. Since
+ * it sees every frame, it also sizes the decoder's arena for the most strips
+ * any of them has.
+ *
+ * Its only argument is the input file in raw CVID format, or in the native
+ * format if `DECODER_NATIVE` is defined.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "decoder.h"
+
+/**
+ * \brief Print an error message, then exit
+ * \param[in] msg The message to print to STDERR
+ */
+__attribute__((noreturn)) void die(const char *msg) {
+  fprintf(stderr, "Error: %s\n", msg);
+  exit(1);
+}
+
+/**
+ * \brief Global decoder for cinepak
+ *
+ * We never decode any frames with this. We only use it to walk the headers.
+ */
+decoder_t decoder;
+
+int main(int argc, char **argv) {
+
+  // We expect exactly one argument
+  if (argc != 2)
+    die("need exactly one argument");
+
+  // Read in the video
+  void *video;
+  size_t video_length;
+  {
+    FILE *video_handle = fopen(argv[1], "r");
+    if (video_handle == NULL)
+      die("failed to open video file");
+    if (fseek(video_handle, 0l, SEEK_END) != 0)
+      die("failed to seek in video file");
+    video_length = ftell(video_handle);
+    if (fseek(video_handle, 0l, SEEK_SET) != 0)
+      die("failed to seek in video file");
+    video = malloc(video_length);
+    if (video == NULL)
+      die("failed to allocate video buffer");
+    if (fread(video, 1, video_length, video_handle) != video_length)
+      die("failed to read video file");
+    fclose(video_handle);
+  }
+
+  // Initialize the decoder
+  decoder_initialize(&decoder, video, video_length);
+
+  // Write out the index, remembering where the keyframes were. Every frame has
+  // a header, so that bounds how many there can be.
+  unsigned int *keyframes =
+      malloc(sizeof(unsigned int) * (video_length / DECODER_FRAME_HEADER + 1));
+  if (keyframes == NULL)
+    die("failed to allocate keyframe buffer");
+  unsigned int frames = 0;
+  unsigned int keyframes_length = 0;
+  unsigned int max_strips = 0;
+
+  printf("// Generated by mkindex from %s\n\n", argv[1]);
+  printf("#include \"video.h\"\n\n");
+  printf("const decoder_frame_info_t video_index[] = {\n");
+  while (decoder_has_next_frame(&decoder)) {
+    // Read the frame
+    decoder_frame_info_t info;
+    if (decoder_peek_frame(&decoder, &info) != SUCCESS)
+      die("got error reading frame header");
+    if (decoder_skip_frame(&decoder) != SUCCESS)
+      die("got error skipping frame");
+    // Write it
+    printf("    {%lu, %lu, %u, %s},\n", (unsigned long)info.offset,
+           (unsigned long)info.length, (unsigned)info.strips,
+           info.keyframe ? "true" : "false");
+    // Next
+    if (info.keyframe)
+      keyframes[keyframes_length++] = frames;
+    if (info.strips > max_strips)
+      max_strips = info.strips;
+    frames++;
+  }
+  printf("};\n");
+  printf("const unsigned int video_index_len = %u;\n\n", frames);
+
+  // The player has to start somewhere
+  if (keyframes_length == 0)
+    die("video has no keyframes");
+
+  printf("const unsigned int video_keyframes[] = {\n");
+  for (unsigned int i = 0; i < keyframes_length; i++)
+    printf("    %u,\n", keyframes[i]);
+  printf("};\n");
+  printf("const unsigned int video_keyframes_len = %u;\n\n", keyframes_length);
+
+  // The decoder checks the strip count against this when validating, so we
+  // only make sure it's in range. The arena can't be empty, even if no frame
+  // has any strips.
+  if (max_strips > DECODER_MAX_STRIPS)
+    die("video has too many strips");
+  printf("const unsigned int video_max_strips = %u;\n", max_strips);
+  printf("decoder_pair_t video_arena[DECODER_ARENA_LENGTH(%u) / "
+         "sizeof(decoder_pair_t)];\n",
+         max_strips != 0 ? max_strips : 1);
+
+  // Done
+  free(keyframes);
+  free(video);
+}
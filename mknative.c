@@ -0,0 +1,306 @@
+/**
+ * \file mknative.c
+ * \brief Transcode a video into the decoder's native format
+ *
+ * This runs on the host as part of the build when `DECODER_NATIVE` is defined.
+ * It decodes every frame of a raw CVID file with the decoder, so the video is
+ * checked along the way, and it writes the same frames in a format that's
+ * cheaper to decode on the device.
+ *
+ * Its arguments are the input file in raw CVID format, then the output file.
+ *
+ * The native format has the same frames, strips, and chunks as CVID. What
+ * differs is:
+ * * Everything is little-endian and aligned to four bytes. Frames and strips
+ *   are always whole words long. Chunks are padded to a whole word, but their
+ *   lengths don't include the padding.
+ * * Frame headers are eight bytes: the frame's length as a 32-bit word,
+ *   including the header, then the number of strips and some flags as 16-bit
+ *   words. Bit 0 of the flags is set for keyframes. There are no dimensions,
+ *   since they were checked here.
+ * * Strip headers are twelve bytes: the strip's length as a 32-bit word,
+ *   including the header, then `x0`, `x1`, `y0`, and `y1` as 16-bit words.
+ *   The coordinates are absolute, and there's no strip ID.
+ * * Chunk headers are the chunk's ID and its length as 16-bit words.
+ * * Codebook chunks are converted to BGR555. They're all chunk `0x2000` for V4
+ *   or chunk `0x2200` for V1. The entries that were updated are stored in runs
+ *   of consecutive entries, each starting with the index of its first entry and
+ *   its number of entries as 16-bit words. Then, each entry is its four pixels
+ *   as 16-bit words, in the same order as CVID.
+ * * Vector chunks are copied as-is. That includes their masks, which stay
+ *   big-endian.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "decoder.h"
+
+/**
+ * \brief Print an error message, then exit
+ * \param[in] msg The message to print to STDERR
+ */
+__attribute__((noreturn)) void die(const char *msg) {
+  fprintf(stderr, "Error: %s\n", msg);
+  exit(1);
+}
+
+/**
+ * \brief Global decoder for cinepak
+ *
+ * We decode every frame with this so we know the video is good, and so we can
+ * take the strips' absolute coordinates from it.
+ */
+decoder_t decoder;
+
+/**
+ * \defgroup OUTPUT
+ * \brief Build up the transcoded video in memory
+ * @{
+ */
+
+unsigned char *output = NULL;
+size_t output_length = 0;
+size_t output_capacity = 0;
+
+/**
+ * \brief Make room for more bytes at the end of the output
+ * \return Where to write them
+ */
+unsigned char *output_grow(size_t length) {
+  if (output_length + length > output_capacity) {
+    output_capacity = 2 * (output_length + length);
+    output = realloc(output, output_capacity);
+    if (output == NULL)
+      die("failed to allocate output buffer");
+  }
+  unsigned char *r = output + output_length;
+  output_length += length;
+  return r;
+}
+
+void output_16(uint16_t value) {
+  unsigned char *out = output_grow(2);
+  out[0] = value >> 0;
+  out[1] = value >> 8;
+}
+
+void output_32(uint32_t value) {
+  unsigned char *out = output_grow(4);
+  out[0] = value >> 0;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+}
+
+/**
+ * \brief Fill in a length that was left blank, now that we know it
+ * \param[in] at Where the blank 32-bit word is in the output
+ * \param[in] value What to write there
+ */
+void output_patch_32(size_t at, uint32_t value) {
+  output[at + 0] = value >> 0;
+  output[at + 1] = value >> 8;
+  output[at + 2] = value >> 16;
+  output[at + 3] = value >> 24;
+}
+
+/**
+ * \brief Fill in a 16-bit length that was left blank
+ * \see output_patch_32()
+ */
+void output_patch_16(size_t at, uint16_t value) {
+  output[at + 0] = value >> 0;
+  output[at + 1] = value >> 8;
+}
+
+/**
+ * \brief Pad the output to a whole word
+ */
+void output_align(void) {
+  while (output_length % 4 != 0)
+    *output_grow(1) = 0;
+}
+
+/** @} */
+
+/**
+ * \defgroup INPUT
+ * \brief Read big-endian CVID fields
+ * @{
+ */
+
+uint16_t input_16(const unsigned char *data) {
+  return (data[0] << 8) | (data[1] << 0);
+}
+
+uint32_t input_32(const unsigned char *data) {
+  return ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) |
+         (data[3] << 0);
+}
+
+/** @} */
+
+/**
+ * \brief Transcode a codebook chunk
+ *
+ * This walks the chunk the same way the decoder does, and it keeps the entries
+ * that were updated. The decoder has already checked the chunk.
+ *
+ * \param[in] chunk_id The CVID chunk ID
+ * \param[in] data The chunk's data, not including the header
+ * \param[in] length The length of the chunk's data
+ */
+void transcode_codebook(uint16_t chunk_id, const unsigned char *data,
+                        size_t length) {
+  const bool v1 = (chunk_id & 0x0200) != 0;
+  const bool bpp12 = (chunk_id & 0x0400) == 0;
+  const bool selective = (chunk_id & 0x0100) != 0;
+
+  // Find every entry that's updated, in order
+  bool updated[DECODER_MAX_ENTRIES] = {false};
+  uint16_t colors[DECODER_MAX_ENTRIES][4];
+  uint32_t update_mask = 0x00000000;
+  size_t index = 0;
+  for (size_t entry = 0; index < length; entry++) {
+    if (selective && entry % 32 == 0) {
+      update_mask = input_32(data + index);
+      index += 4;
+    }
+    if (selective && (update_mask & (0x80000000 >> (entry % 32))) == 0)
+      continue;
+    if (entry >= DECODER_MAX_ENTRIES)
+      die("codebook has too many entries");
+    const int8_t u = bpp12 ? (int8_t)data[index + 4] : 0;
+    const int8_t v = bpp12 ? (int8_t)data[index + 5] : 0;
+    for (size_t i = 0; i < 4; i++)
+      colors[entry][i] = decoder_yuv_to_bgr555(data[index + i], u, v);
+    updated[entry] = true;
+    index += bpp12 ? 6 : 4;
+  }
+
+  // Write them out in runs
+  const size_t chunk_start = output_length;
+  output_16(v1 ? 0x2200 : 0x2000);
+  output_16(0);
+  for (size_t first = 0; first < DECODER_MAX_ENTRIES;) {
+    if (!updated[first]) {
+      first++;
+      continue;
+    }
+    size_t count = 0;
+    while (first + count < DECODER_MAX_ENTRIES && updated[first + count])
+      count++;
+    output_16(first);
+    output_16(count);
+    for (size_t entry = first; entry < first + count; entry++) {
+      for (size_t i = 0; i < 4; i++)
+        output_16(colors[entry][i]);
+    }
+    first += count;
+  }
+  output_patch_16(chunk_start + 2, output_length - chunk_start);
+}
+
+int main(int argc, char **argv) {
+
+  // We expect exactly two arguments
+  if (argc != 3)
+    die("need an input and an output file");
+
+  // Read in the video
+  unsigned char *video;
+  size_t video_length;
+  {
+    FILE *video_handle = fopen(argv[1], "r");
+    if (video_handle == NULL)
+      die("failed to open video file");
+    if (fseek(video_handle, 0l, SEEK_END) != 0)
+      die("failed to seek in video file");
+    video_length = ftell(video_handle);
+    if (fseek(video_handle, 0l, SEEK_SET) != 0)
+      die("failed to seek in video file");
+    video = malloc(video_length);
+    if (video == NULL)
+      die("failed to allocate video buffer");
+    if (fread(video, 1, video_length, video_handle) != video_length)
+      die("failed to read video file");
+    fclose(video_handle);
+  }
+
+  // Initialize the decoder
+  decoder_initialize(&decoder, video, video_length);
+
+  size_t frames = 0;
+  while (decoder_has_next_frame(&decoder)) {
+    // Decode the frame, which checks it
+    decoder_frame_info_t info;
+    if (decoder_peek_frame(&decoder, &info) != SUCCESS)
+      die("got error reading frame header");
+    if (decoder_compute_frame(&decoder) != SUCCESS) {
+      fprintf(stderr, "Error: got error decoding frame %zu\n", frames);
+      exit(1);
+    }
+
+    // Write the frame header, leaving the length for later
+    const size_t frame_start = output_length;
+    output_32(0);
+    output_16(info.strips);
+    output_16(info.keyframe ? 0x0001 : 0x0000);
+
+    // Write every strip
+    const unsigned char *strip_data = video + info.offset + 10;
+    for (size_t i = 0; i < info.strips; i++) {
+      const size_t strip_length = input_16(strip_data + 2);
+      const decoder_strip_t *strip = decoder.strips + i;
+
+      // The decoder already worked out where the strip is
+      const size_t strip_start = output_length;
+      output_32(0);
+      output_16(strip->x0);
+      output_16(strip->x1);
+      output_16(strip->y0);
+      output_16(strip->y1);
+
+      // Convert codebooks, and copy everything else
+      for (size_t chunk_index = 12; chunk_index != strip_length;) {
+        const unsigned char *chunk_data = strip_data + chunk_index;
+        const uint16_t chunk_id = input_16(chunk_data + 0);
+        const size_t chunk_length = input_16(chunk_data + 2);
+        if ((chunk_id & 0xf000) == 0x2000) {
+          transcode_codebook(chunk_id, chunk_data + 4, chunk_length - 4);
+        } else {
+          output_16(chunk_id);
+          output_16(chunk_length);
+          for (size_t j = 4; j < chunk_length; j++)
+            *output_grow(1) = chunk_data[j];
+        }
+        output_align();
+        chunk_index += chunk_length;
+      }
+
+      output_patch_32(strip_start, output_length - strip_start);
+      strip_data += strip_length;
+    }
+
+    output_patch_32(frame_start, output_length - frame_start);
+    frames++;
+  }
+
+  // Write out the result
+  {
+    FILE *output_handle = fopen(argv[2], "w");
+    if (output_handle == NULL)
+      die("failed to open output file");
+    if (fwrite(output, 1, output_length, output_handle) != output_length)
+      die("failed to write output file");
+    if (fclose(output_handle) != 0)
+      die("failed to close output file");
+  }
+  printf("Transcoded %zu frames from %zu bytes to %zu bytes\n", frames,
+         video_length, output_length);
+
+  // Done
+  free(output);
+  free(video);
+}
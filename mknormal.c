@@ -0,0 +1,918 @@
+/**
+ * \file mknormal.c
+ * \brief Rewrite a video so it's as cheap as possible for the decoder
+ *
+ * This runs on the host as part of the build. It reads a raw CVID file and
+ * writes another one that decodes to exactly the same frames, but that's laid
+ * out the way the decoder likes:
+ * * Every strip has absolute coordinates.
+ * * Codebook chunks only have the entries that the strip's blocks use and that
+ *   the decoder doesn't already have. Updates that change nothing are dropped,
+ *   so the decoder doesn't convert them or copy a shared codebook for them.
+ *   Updates are full if they start at the first entry and selective otherwise,
+ *   and they're 8bpp if none of their entries have color.
+ * * Vector chunks are the cheapest kind that can hold the strip's blocks. That
+ *   is, chunk `0x3200` if they're all V1, chunk `0x3000` if none are skipped,
+ *   and chunk `0x3100` otherwise.
+ *
+ * To do this, each frame is decoded into what every block ends up as, and what
+ * the codebook entries it uses were at that point. The strips are then laid out
+ * again over that. By default, they start on the same rows as the input's did.
+ * With `-s`, they're cut into as many bands of equal height instead. Either
+ * way, a strip is also cut short if the next row of blocks needs a different
+ * value for a codebook entry than the rows before it did, so there can be more
+ * strips than asked for.
+ *
+ * Keyframes still rebuild every codebook entry they use, since the decoder
+ * relies on that when seeking. So do the frames after them, for entries the
+ * keyframe didn't rebuild. The decoder's codebooks before a keyframe are never
+ * relied on.
+ *
+ * Once it's done, this checks itself. It decodes both videos with the decoder,
+ * and it fails if any frame differs. It also seeks to every keyframe in both,
+ * and checks the frames up to the next keyframe. A frame is only checked there
+ * if the input decodes it the same way after seeking as it does straight
+ * through.
+ *
+ * Its arguments are the input file and the output file, both in raw CVID
+ * format. The options are:
+ * * `-s N`: Lay out each frame as `N` strips
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "decoder.h"
+
+#ifndef DECODER_VALIDATE
+#error "The input is only parsed here after the decoder has checked it"
+#endif
+#ifdef DECODER_NATIVE
+#error "Normalizing reads and writes CVID"
+#endif
+
+/**
+ * \brief How many blocks wide a frame is
+ */
+#define COLUMNS (DECODER_WIDTH / 4)
+
+/**
+ * \brief Print an error message, then exit
+ * \param[in] msg The message to print to STDERR
+ */
+__attribute__((noreturn)) void die(const char *msg) {
+  fprintf(stderr, "Error: %s\n", msg);
+  exit(1);
+}
+
+/**
+ * \brief Print an error message about a frame, then exit
+ * \param[in] msg The message to print to STDERR
+ * \param[in] frame The index of the frame
+ */
+__attribute__((noreturn)) void die_frame(const char *msg, size_t frame) {
+  fprintf(stderr, "Error: %s in frame %zu\n", msg, frame);
+  exit(1);
+}
+
+/**
+ * \brief Decoders for the input and the output
+ *
+ * The input is decoded first to check it, so it can be parsed here without
+ * checking it again. Both are decoded at the end to check the output.
+ */
+decoder_t decoder_input;
+decoder_t decoder_output;
+
+/**
+ * \defgroup OUTPUT
+ * \brief Build up the rewritten video in memory
+ * @{
+ */
+
+unsigned char *output = NULL;
+size_t output_length = 0;
+size_t output_capacity = 0;
+
+/**
+ * \brief Make room for more bytes at the end of the output
+ * \return Where to write them
+ */
+unsigned char *output_grow(size_t length) {
+  if (output_length + length > output_capacity) {
+    output_capacity = 2 * (output_length + length);
+    output = realloc(output, output_capacity);
+    if (output == NULL)
+      die("failed to allocate output buffer");
+  }
+  unsigned char *r = output + output_length;
+  output_length += length;
+  return r;
+}
+
+void output_8(uint8_t value) { *output_grow(1) = value; }
+
+void output_16(uint16_t value) {
+  unsigned char *out = output_grow(2);
+  out[0] = value >> 8;
+  out[1] = value >> 0;
+}
+
+void output_32(uint32_t value) {
+  unsigned char *out = output_grow(4);
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value >> 0;
+}
+
+/**
+ * \brief Fill in a 16-bit length that was left blank, now that we know it
+ *
+ * If the length doesn't fit, this method calls die() and exits.
+ *
+ * \param[in] at Where the blank word is in the output
+ * \param[in] value What to write there
+ */
+void output_patch_16(size_t at, size_t value) {
+  if (value > 0xffff)
+    die("strip is too long, so ask for more strips with -s");
+  output[at + 0] = value >> 8;
+  output[at + 1] = value >> 0;
+}
+
+/**
+ * \brief Fill in a mask that was left blank
+ * \see output_patch_16()
+ */
+void output_patch_32(size_t at, uint32_t value) {
+  output[at + 0] = value >> 24;
+  output[at + 1] = value >> 16;
+  output[at + 2] = value >> 8;
+  output[at + 3] = value >> 0;
+}
+
+/**
+ * \brief Fill in a frame's 24-bit length
+ * \see output_patch_16()
+ */
+void output_patch_24(size_t at, size_t value) {
+  if (value > 0xffffff)
+    die("frame is too long");
+  output[at + 0] = value >> 16;
+  output[at + 1] = value >> 8;
+  output[at + 2] = value >> 0;
+}
+
+/**
+ * \brief Masks being written between the data they describe
+ *
+ * The decoder reads the next mask just before it needs the first bit in it. So,
+ * a mask's space is reserved just before its first bit is set, and the mask is
+ * filled in once all its bits are known.
+ */
+typedef struct output_bits_t {
+  size_t at;
+  uint32_t bits;
+  uint_fast8_t count;
+} output_bits_t;
+
+/**
+ * \brief Start writing masks
+ * \param[out] bits The masks to start
+ */
+void output_bits_start(output_bits_t *bits) {
+  bits->at = SIZE_MAX;
+  bits->bits = 0x00000000;
+  bits->count = 32;
+}
+
+/**
+ * \brief Write the next bit, starting a new mask if needed
+ * \param[inout] bits The masks to write to
+ * \param[in] bit The value of the bit
+ */
+void output_bits_put(output_bits_t *bits, bool bit) {
+  if (bits->count == 32) {
+    if (bits->at != SIZE_MAX)
+      output_patch_32(bits->at, bits->bits);
+    bits->at = output_length;
+    output_32(0);
+    bits->bits = 0x00000000;
+    bits->count = 0;
+  }
+  if (bit)
+    bits->bits |= 0x80000000 >> bits->count;
+  bits->count++;
+}
+
+/**
+ * \brief Fill in the last mask
+ * \param[in] bits The masks to finish
+ */
+void output_bits_finish(const output_bits_t *bits) {
+  if (bits->at != SIZE_MAX)
+    output_patch_32(bits->at, bits->bits);
+}
+
+/** @} */
+
+/**
+ * \defgroup INPUT
+ * \brief Read big-endian CVID fields
+ * @{
+ */
+
+uint16_t input_16(const unsigned char *data) {
+  return (data[0] << 8) | (data[1] << 0);
+}
+
+uint32_t input_32(const unsigned char *data) {
+  return ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) |
+         (data[3] << 0);
+}
+
+/**
+ * \brief A chunk being read along with the masks in it
+ */
+typedef struct input_bits_t {
+  const unsigned char *data;
+  size_t index;
+  uint32_t bits;
+  uint_fast8_t count;
+} input_bits_t;
+
+/**
+ * \brief Read the next bit, reading the next mask first if needed
+ * \param[inout] bits The chunk to read from
+ * \return Whether the bit was set
+ */
+bool input_bits_take(input_bits_t *bits) {
+  if (bits->count == 0) {
+    bits->bits = input_32(bits->data + bits->index);
+    bits->index += 4;
+    bits->count = 32;
+  }
+  bool r = (bits->bits & 0x80000000) != 0;
+  bits->bits <<= 1;
+  bits->count--;
+  return r;
+}
+
+/** @} */
+
+/**
+ * \defgroup CODEBOOKS
+ * \brief Keep track of what's in each strip's codebooks
+ *
+ * Entries are kept as CVID has them, since two entries that look the same
+ * there always convert to the same colors. An 8bpp entry is the same as a 12bpp
+ * one with no color. The decoder starts with every entry black, which is what
+ * an entry of all zeros converts to.
+ *
+ * @{
+ */
+
+/**
+ * \brief A codebook entry, as its four lumas and its two chromas
+ */
+typedef struct entry_t {
+  unsigned char yuv[6];
+} entry_t;
+
+/**
+ * \brief One strip's codebooks, indexed by whether they're for V1
+ *
+ * We also keep whether each entry is known. That's only used for the output,
+ * where an entry stops being known at every keyframe, since the player can
+ * seek to one from anywhere.
+ */
+typedef struct books_t {
+  entry_t entries[2][DECODER_MAX_ENTRIES];
+  bool known[2][DECODER_MAX_ENTRIES];
+} books_t;
+
+/**
+ * \brief The codebooks of each strip as the input has them, then the output
+ */
+books_t input_books[DECODER_MAX_STRIPS];
+books_t output_books[DECODER_MAX_STRIPS];
+
+/**
+ * \brief How many codebook entries the input and the output have
+ */
+size_t input_entries = 0;
+size_t output_entries = 0;
+
+/**
+ * \brief Apply a codebook chunk from the input
+ *
+ * This walks the chunk the same way the decoder does. The decoder has already
+ * checked the chunk.
+ *
+ * \param[inout] books The strip's codebooks
+ * \param[in] chunk_id The CVID chunk ID
+ * \param[in] data The chunk's data, not including the header
+ * \param[in] length The length of the chunk's data
+ */
+void read_codebook(books_t *books, uint16_t chunk_id, const unsigned char *data,
+                   size_t length) {
+  const bool v1 = (chunk_id & 0x0200) != 0;
+  const bool bpp12 = (chunk_id & 0x0400) == 0;
+  const bool selective = (chunk_id & 0x0100) != 0;
+
+  input_bits_t chunk = {data, 0, 0x00000000, 0};
+  for (size_t entry = 0; chunk.index < length; entry++) {
+    if (selective && !input_bits_take(&chunk))
+      continue;
+    entry_t *e = books->entries[v1] + entry;
+    memset(e, 0, sizeof(*e));
+    memcpy(e->yuv, data + chunk.index, bpp12 ? 6 : 4);
+    chunk.index += bpp12 ? 6 : 4;
+    input_entries++;
+  }
+}
+
+/**
+ * \brief Write a codebook chunk with just the entries that are needed
+ *
+ * Nothing is written if no entry is needed.
+ *
+ * \param[in] v1 Whether it's for the V1 codebook or the V4 codebook
+ * \param[in] needed Which entries to write
+ * \param[in] entries What to write for each of them
+ */
+void write_codebook(bool v1, const bool needed[DECODER_MAX_ENTRIES],
+                    const entry_t entries[DECODER_MAX_ENTRIES]) {
+
+  // Find out what kind of update we need
+  size_t count = 0;
+  size_t end = 0;
+  bool bpp12 = false;
+  for (size_t i = 0; i < DECODER_MAX_ENTRIES; i++) {
+    if (!needed[i])
+      continue;
+    count++;
+    end = i + 1;
+    if (entries[i].yuv[4] != 0 || entries[i].yuv[5] != 0)
+      bpp12 = true;
+  }
+  if (count == 0)
+    return;
+  const bool selective = count != end;
+  output_entries += count;
+
+  // Write it
+  const size_t chunk_start = output_length;
+  output_16(0x2000 | (v1 ? 0x0200 : 0x0000) | (selective ? 0x0100 : 0x0000) |
+            (bpp12 ? 0x0000 : 0x0400));
+  output_16(0);
+  output_bits_t mask;
+  output_bits_start(&mask);
+  for (size_t i = 0; i < end; i++) {
+    if (selective)
+      output_bits_put(&mask, needed[i]);
+    if (!needed[i])
+      continue;
+    memcpy(output_grow(bpp12 ? 6 : 4), entries[i].yuv, bpp12 ? 6 : 4);
+  }
+  output_bits_finish(&mask);
+  output_patch_16(chunk_start + 2, output_length - chunk_start);
+}
+
+/** @} */
+
+/**
+ * \defgroup BLOCKS
+ * \brief What every block of a frame ends up as
+ * @{
+ */
+
+typedef enum block_kind_t {
+  BLOCK_SKIPPED,
+  BLOCK_V1,
+  BLOCK_V4,
+} block_kind_t;
+
+/**
+ * \brief The last thing written to a block in this frame
+ *
+ * This has the index of every codebook entry the block used, and what those
+ * entries were when it was written. A V1 block only uses the first.
+ */
+typedef struct block_t {
+  block_kind_t kind;
+  uint8_t indices[4];
+  entry_t entries[4];
+} block_t;
+
+block_t blocks[DECODER_BLOCK_ROWS][COLUMNS];
+
+/**
+ * \brief Write a block from the input
+ * \param[in] books The codebooks the strip had when it wrote the block
+ * \param[in] row The block's row
+ * \param[in] column The block's column
+ * \param[in] v4 Whether the block is V4 or V1
+ * \param[in] indices The block's vectors, one for V1, or four for V4
+ */
+void write_block(const books_t *books, size_t row, size_t column, bool v4,
+                 const unsigned char *indices) {
+  block_t *block = &blocks[row][column];
+  block->kind = v4 ? BLOCK_V4 : BLOCK_V1;
+  for (size_t i = 0; i < (v4 ? 4 : 1); i++) {
+    block->indices[i] = indices[i];
+    block->entries[i] = books->entries[!v4][indices[i]];
+  }
+}
+
+/**
+ * \brief Apply a vector chunk from the input
+ * \param[in] books The codebooks of the strip the chunk is in
+ * \param[in] chunk_id The CVID chunk ID
+ * \param[in] data The chunk's data, not including the header
+ * \param[in] x0 The strip's first column of pixels
+ * \param[in] x1 The strip's last column of pixels, exclusive
+ * \param[in] y0 The strip's first row of pixels
+ * \param[in] y1 The strip's last row of pixels, exclusive
+ */
+void read_vectors(const books_t *books, uint16_t chunk_id,
+                  const unsigned char *data, size_t x0, size_t x1, size_t y0,
+                  size_t y1) {
+  input_bits_t chunk = {data, 0, 0x00000000, 0};
+  for (size_t row = y0 / 4; row < y1 / 4; row++) {
+    for (size_t column = x0 / 4; column < x1 / 4; column++) {
+      bool v4 = false;
+      if (chunk_id == 0x3100) {
+        if (!input_bits_take(&chunk))
+          continue;
+        v4 = input_bits_take(&chunk);
+      } else if (chunk_id == 0x3000) {
+        v4 = input_bits_take(&chunk);
+      }
+      write_block(books, row, column, v4, data + chunk.index);
+      chunk.index += v4 ? 4 : 1;
+    }
+  }
+}
+
+/**
+ * \brief Read a frame of the input into `blocks`
+ *
+ * This also updates the input's codebooks, and it marks the rows the input's
+ * strips start on.
+ *
+ * \param[in] frame The frame's data, starting at its header
+ * \param[out] starts Which rows of blocks a strip starts on
+ */
+void read_frame(const unsigned char *frame,
+                bool starts[DECODER_BLOCK_ROWS]) {
+  const bool keyframe = (frame[0] & 0x01) != 0;
+  const size_t strips = input_16(frame + 8);
+
+  memset(blocks, 0, sizeof(blocks));
+  const unsigned char *strip = frame + 10;
+  size_t y1_previous = 0;
+  for (size_t i = 0; i < strips; i++) {
+    const size_t strip_length = input_16(strip + 2);
+
+    // Work out where the strip is, the same way the decoder does
+    size_t y0 = input_16(strip + 4);
+    const size_t x0 = input_16(strip + 6);
+    size_t y1 = input_16(strip + 8);
+    const size_t x1 = input_16(strip + 10);
+    if (y0 == 0 && i > 0) {
+      y0 = y1_previous;
+      y1 += y1_previous;
+    }
+    y1_previous = y1;
+    starts[y0 / 4] = true;
+
+    // Inter-coded frames start each strip with the previous strip's codebooks
+    if (!keyframe && i > 0)
+      input_books[i] = input_books[i - 1];
+
+    for (size_t chunk_index = 12; chunk_index != strip_length;) {
+      const unsigned char *chunk = strip + chunk_index;
+      const uint16_t chunk_id = input_16(chunk + 0);
+      const size_t chunk_length = input_16(chunk + 2);
+      if ((chunk_id & 0xf000) == 0x2000)
+        read_codebook(input_books + i, chunk_id, chunk + 4, chunk_length - 4);
+      else
+        read_vectors(input_books + i, chunk_id, chunk + 4, x0, x1, y0, y1);
+      chunk_index += chunk_length;
+    }
+
+    strip += strip_length;
+  }
+}
+
+/** @} */
+
+/**
+ * \defgroup LAYOUT
+ * \brief Lay out strips over a frame's blocks
+ * @{
+ */
+
+/**
+ * \brief A strip of the output, in blocks
+ */
+typedef struct band_t {
+  size_t row;
+  size_t rows;
+  size_t column;
+  size_t columns;
+} band_t;
+
+/**
+ * \brief Which codebook entries a strip uses, and what they have to be
+ */
+typedef struct needs_t {
+  entry_t entries[2][DECODER_MAX_ENTRIES];
+  bool used[2][DECODER_MAX_ENTRIES];
+} needs_t;
+
+band_t bands[DECODER_MAX_STRIPS];
+needs_t band_needs[DECODER_MAX_STRIPS];
+size_t bands_length;
+
+/**
+ * \brief Check whether a row of blocks has anything written to it
+ */
+bool row_empty(size_t row) {
+  for (size_t column = 0; column < COLUMNS; column++) {
+    if (blocks[row][column].kind != BLOCK_SKIPPED)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * \brief Add the codebook entries a row of blocks uses to a strip's
+ * \param[inout] needs The entries the strip uses so far
+ * \param[in] row The row to add
+ * \return Whether every entry agreed, and the row was added
+ */
+bool row_add(needs_t *needs, size_t row) {
+  needs_t trial = *needs;
+  for (size_t column = 0; column < COLUMNS; column++) {
+    const block_t *block = &blocks[row][column];
+    if (block->kind == BLOCK_SKIPPED)
+      continue;
+    const bool v1 = block->kind == BLOCK_V1;
+    for (size_t i = 0; i < (v1 ? 1 : 4); i++) {
+      const size_t index = block->indices[i];
+      if (trial.used[v1][index] &&
+          memcmp(&trial.entries[v1][index], &block->entries[i],
+                 sizeof(entry_t)) != 0)
+        return false;
+      trial.used[v1][index] = true;
+      trial.entries[v1][index] = block->entries[i];
+    }
+  }
+  *needs = trial;
+  return true;
+}
+
+/**
+ * \brief Finish the last strip, dropping the empty rows at its end
+ * \param[in] last_row The last row of the strip with anything written to it
+ */
+void band_finish(size_t last_row) {
+  band_t *band = bands + bands_length - 1;
+  band->rows = last_row + 1 - band->row;
+  size_t first = COLUMNS;
+  size_t end = 0;
+  for (size_t row = band->row; row <= last_row; row++) {
+    for (size_t column = 0; column < COLUMNS; column++) {
+      if (blocks[row][column].kind == BLOCK_SKIPPED)
+        continue;
+      if (column < first)
+        first = column;
+      if (column + 1 > end)
+        end = column + 1;
+    }
+  }
+  band->column = first;
+  band->columns = end - first;
+}
+
+/**
+ * \brief Lay out the strips for the frame in `blocks`
+ *
+ * If the frame can't be laid out, this method calls die() and exits.
+ *
+ * \param[in] starts Which rows of blocks a strip should start on
+ * \param[in] frame The frame's index, for errors
+ */
+void layout_frame(const bool starts[DECODER_BLOCK_ROWS], size_t frame) {
+  bands_length = 0;
+  bool open = false;
+  size_t last_row = 0;
+  for (size_t row = 0; row < DECODER_BLOCK_ROWS; row++) {
+    const bool empty = row_empty(row);
+
+    // See if the row can go on the strip we have
+    if (open && starts[row]) {
+      band_finish(last_row);
+      open = false;
+    }
+    if (empty)
+      continue;
+    if (open && !row_add(band_needs + bands_length - 1, row)) {
+      band_finish(last_row);
+      open = false;
+    }
+
+    // If not, start a new one
+    if (!open) {
+      if (bands_length == DECODER_MAX_STRIPS)
+        die_frame("too many strips are needed, so ask for fewer with -s",
+                  frame);
+      bands[bands_length].row = row;
+      memset(band_needs + bands_length, 0, sizeof(needs_t));
+      if (!row_add(band_needs + bands_length, row))
+        die_frame("a row of blocks needs two values for a codebook entry",
+                  frame);
+      bands_length++;
+      open = true;
+    }
+    last_row = row;
+  }
+  if (open)
+    band_finish(last_row);
+}
+
+/**
+ * \brief Write the vectors for a strip
+ *
+ * This uses the cheapest kind of chunk that can hold them.
+ *
+ * \param[in] band The strip to write
+ */
+void write_vectors(const band_t *band) {
+  bool skipped = false;
+  bool v4 = false;
+  for (size_t row = band->row; row < band->row + band->rows; row++) {
+    for (size_t column = band->column; column < band->column + band->columns;
+         column++) {
+      skipped |= blocks[row][column].kind == BLOCK_SKIPPED;
+      v4 |= blocks[row][column].kind == BLOCK_V4;
+    }
+  }
+  const uint16_t chunk_id = skipped ? 0x3100 : v4 ? 0x3000 : 0x3200;
+
+  const size_t chunk_start = output_length;
+  output_16(chunk_id);
+  output_16(0);
+  output_bits_t mask;
+  output_bits_start(&mask);
+  for (size_t row = band->row; row < band->row + band->rows; row++) {
+    for (size_t column = band->column; column < band->column + band->columns;
+         column++) {
+      const block_t *block = &blocks[row][column];
+      if (chunk_id == 0x3100) {
+        output_bits_put(&mask, block->kind != BLOCK_SKIPPED);
+        if (block->kind == BLOCK_SKIPPED)
+          continue;
+      }
+      if (chunk_id != 0x3200)
+        output_bits_put(&mask, block->kind == BLOCK_V4);
+      for (size_t i = 0; i < (block->kind == BLOCK_V4 ? 4 : 1); i++)
+        output_8(block->indices[i]);
+    }
+  }
+  output_bits_finish(&mask);
+  output_patch_16(chunk_start + 2, output_length - chunk_start);
+}
+
+/**
+ * \brief Write the frame in `blocks` with the strips that were laid out
+ * \param[in] frame The input frame, for its header
+ */
+void write_frame(const unsigned char *frame) {
+  const bool keyframe = (frame[0] & 0x01) != 0;
+
+  // The player can seek to a keyframe from anywhere
+  if (keyframe) {
+    for (size_t i = 0; i < DECODER_MAX_STRIPS; i++)
+      memset(output_books[i].known, 0, sizeof(output_books[i].known));
+  }
+
+  // Same flags and dimensions, but the length and strips are ours
+  const size_t frame_start = output_length;
+  output_8(frame[0]);
+  output_8(0);
+  output_16(0);
+  output_16(input_16(frame + 4));
+  output_16(input_16(frame + 6));
+  output_16(bands_length);
+
+  for (size_t i = 0; i < bands_length; i++) {
+    const band_t *band = bands + i;
+    const needs_t *needs = band_needs + i;
+
+    // Write the header, leaving the length for later
+    const size_t strip_start = output_length;
+    output_16(keyframe ? 0x1000 : 0x1100);
+    output_16(0);
+    output_16(4 * band->row);
+    output_16(4 * band->column);
+    output_16(4 * (band->row + band->rows));
+    output_16(4 * (band->column + band->columns));
+
+    // Update just the entries that aren't already right. The strip starts with
+    // the same codebooks as it would in the decoder.
+    books_t *books = output_books + i;
+    if (!keyframe && i > 0)
+      *books = output_books[i - 1];
+    for (size_t v1 = 0; v1 < 2; v1++) {
+      bool needed[DECODER_MAX_ENTRIES];
+      for (size_t j = 0; j < DECODER_MAX_ENTRIES; j++) {
+        needed[j] = needs->used[v1][j] &&
+                    (!books->known[v1][j] ||
+                     memcmp(&books->entries[v1][j], &needs->entries[v1][j],
+                            sizeof(entry_t)) != 0);
+        if (needed[j]) {
+          books->entries[v1][j] = needs->entries[v1][j];
+          books->known[v1][j] = true;
+        }
+      }
+      // V4 goes first, like the encoder does it
+      write_codebook(v1 == 1, needed, needs->entries[v1]);
+    }
+
+    write_vectors(band);
+    output_patch_16(strip_start + 2, output_length - strip_start);
+  }
+
+  output_patch_24(frame_start + 1, output_length - frame_start);
+}
+
+/** @} */
+
+/**
+ * \brief Hash the frame a decoder just decoded
+ */
+uint64_t hash_frame(const decoder_t *decoder) {
+  const unsigned char *data =
+      (const unsigned char *)decoder_get_framebuffer(decoder);
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < sizeof(uint16_t) * DECODER_OUTPUT_PIXELS; i++)
+    hash = (hash ^ data[i]) * 0x100000001b3;
+  return hash;
+}
+
+/**
+ * \brief Check whether two decoders just decoded the same frame
+ */
+bool same_frame(const decoder_t *a, const decoder_t *b) {
+  return memcmp(decoder_get_framebuffer(a), decoder_get_framebuffer(b),
+                sizeof(uint16_t) * DECODER_OUTPUT_PIXELS) == 0;
+}
+
+int main(int argc, char **argv) {
+
+  // Parse options
+  size_t strips = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+    case 's':
+      strips = strtoul(optarg, NULL, 10);
+      if (strips == 0 || strips > DECODER_MAX_STRIPS)
+        die("number of strips is out of range");
+      break;
+    default:
+      die("usage: mknormal [-s strips] input output");
+    }
+  }
+  if (optind != argc - 2)
+    die("need an input and an output file");
+
+  // Read in the video
+  unsigned char *video;
+  size_t video_length;
+  {
+    FILE *video_handle = fopen(argv[optind], "r");
+    if (video_handle == NULL)
+      die("failed to open video file");
+    if (fseek(video_handle, 0l, SEEK_END) != 0)
+      die("failed to seek in video file");
+    video_length = ftell(video_handle);
+    if (fseek(video_handle, 0l, SEEK_SET) != 0)
+      die("failed to seek in video file");
+    video = malloc(video_length);
+    if (video == NULL)
+      die("failed to allocate video buffer");
+    if (fread(video, 1, video_length, video_handle) != video_length)
+      die("failed to read video file");
+    fclose(video_handle);
+  }
+
+  // Decode every frame to check the input, and remember what they look like.
+  // Every frame has a header, so that bounds how many there can be.
+  const size_t frames_capacity = video_length / DECODER_FRAME_HEADER + 1;
+  decoder_frame_info_t *input_info =
+      malloc(sizeof(decoder_frame_info_t) * frames_capacity);
+  decoder_frame_info_t *output_info =
+      malloc(sizeof(decoder_frame_info_t) * frames_capacity);
+  uint64_t *hashes = malloc(sizeof(uint64_t) * frames_capacity);
+  if (input_info == NULL || output_info == NULL || hashes == NULL)
+    die("failed to allocate frame buffer");
+  size_t frames = 0;
+  size_t input_strips = 0;
+  decoder_initialize(&decoder_input, video, video_length);
+  while (decoder_has_next_frame(&decoder_input)) {
+    if (decoder_peek_frame(&decoder_input, input_info + frames) != SUCCESS)
+      die("got error reading frame header");
+    if (decoder_compute_frame(&decoder_input) != SUCCESS)
+      die_frame("got error decoding", frames);
+    hashes[frames] = hash_frame(&decoder_input);
+    input_strips += input_info[frames].strips;
+    frames++;
+  }
+
+  // Rewrite every frame
+  bool starts[DECODER_BLOCK_ROWS];
+  size_t output_strips = 0;
+  for (size_t i = 0; i < frames; i++) {
+    const unsigned char *frame = video + input_info[i].offset;
+    memset(starts, 0, sizeof(starts));
+    read_frame(frame, starts);
+    if (strips != 0) {
+      memset(starts, 0, sizeof(starts));
+      const size_t rows = (DECODER_BLOCK_ROWS + strips - 1) / strips;
+      for (size_t row = 0; row < DECODER_BLOCK_ROWS; row += rows)
+        starts[row] = true;
+    }
+    layout_frame(starts, i);
+    write_frame(frame);
+    output_strips += bands_length;
+  }
+
+  // Check that every frame comes out the same
+  decoder_initialize(&decoder_input, video, video_length);
+  decoder_initialize(&decoder_output, output, output_length);
+  for (size_t i = 0; i < frames; i++) {
+    if (decoder_peek_frame(&decoder_output, output_info + i) != SUCCESS)
+      die("got error reading frame header of output");
+    if (decoder_compute_frame(&decoder_input) != SUCCESS ||
+        decoder_compute_frame(&decoder_output) != SUCCESS)
+      die_frame("got error decoding output", i);
+    if (!same_frame(&decoder_input, &decoder_output))
+      die_frame("output differs from input", i);
+  }
+  if (decoder_has_next_frame(&decoder_output))
+    die("output has extra frames");
+
+  // Check the same after seeking to each keyframe, from wherever we are. Only
+  // check frames the input gets right after seeking.
+  size_t unchecked = 0;
+  for (size_t i = 0; i < frames; i++) {
+    if (!input_info[i].keyframe)
+      continue;
+    if (decoder_seek_keyframe(&decoder_input, input_info + i) != SUCCESS ||
+        decoder_seek_keyframe(&decoder_output, output_info + i) != SUCCESS)
+      die_frame("got error seeking", i);
+    for (size_t j = i; j < frames && (j == i || !input_info[j].keyframe);
+         j++) {
+      if (decoder_compute_frame(&decoder_input) != SUCCESS ||
+          decoder_compute_frame(&decoder_output) != SUCCESS)
+        die_frame("got error decoding output after seeking", j);
+      if (hash_frame(&decoder_input) != hashes[j])
+        unchecked++;
+      else if (!same_frame(&decoder_input, &decoder_output))
+        die_frame("output differs from input after seeking", j);
+    }
+  }
+
+  // Write out the result
+  {
+    FILE *output_handle = fopen(argv[optind + 1], "w");
+    if (output_handle == NULL)
+      die("failed to open output file");
+    if (fwrite(output, 1, output_length, output_handle) != output_length)
+      die("failed to write output file");
+    if (fclose(output_handle) != 0)
+      die("failed to close output file");
+  }
+  printf("Normalized %zu frames from %zu bytes to %zu bytes\n", frames,
+         video_length, output_length);
+  printf("Strips went from %zu to %zu, and codebook entries from %zu to %zu\n",
+         input_strips, output_strips, input_entries, output_entries);
+  if (unchecked != 0)
+    printf("Skipped checking %zu frames after seeking, since the input doesn't "
+           "decode them the same way then\n",
+           unchecked);
+
+  // Done
+  free(hashes);
+  free(output_info);
+  free(input_info);
+  free(output);
+  free(video);
+}
@@ -12,6 +12,11 @@ _start:
     AND FP, FP, 0
     AND LR, LR, 0
 
+    ; We don't clear .bss. The simulator starts with all of memory zeroed, and
+    ; the player's globals count on that. The decoder doesn't, since it sets
+    ; up everything it reads when it's initialized, so there's nothing to
+    ; clear for it either.
+
     ; Initialize the stack pointer
     ; Recall that the argument is 32-bit *signed*, so we have to flip the bits
     PSEUDO.LOADCONSTW R6, ~0x0fffffff
@@ -7,15 +7,39 @@
  * is coded correctly.
  *
  * It loads a video into memory, then generates frames from it and writes them
- * out as NetPBM images.
+ * out as NetPBM images. Alternatively, it can time how long the decoder takes
+ * on each frame.
  *
- * Its first argument is the input file in raw CVID format - without the
- * container. It writes files into a hardcoded directory.
+ * Its positional arguments are input files in raw CVID format - without the
+ * container. Several can only be given when validating or doing checksums, in
+ * which case they're processed in order. The options are:
+ * * `-o DIR`: Write images into `DIR` instead of `test-out`
+ * * `-i N`: Write every `N`-th frame instead of every `30`-th
+ * * `-b N`: Decode the whole video `N` times without writing anything, then
+ *   report how long frames took
+ * * `-w N`: Report the `N` slowest frames when benchmarking instead of `5`
+ * * `-s FORMAT`: Write every frame to a single stream instead of to images.
+ *   `FORMAT` is `raw` for RGB24 or `y4m` for YUV4MPEG2 in 4:4:4
+ * * `-f FILE`: Write the stream to `FILE` instead of STDOUT
+ * * `-c FILE`: Write checksums for every frame to `FILE` instead of images
+ * * `-v FILE`: Check every frame against the checksums in `FILE`, stopping at
+ *   the first one that differs
+ * * `-n`: Only check that the videos decode, without writing anything
+ * * `-j N`: Use `N` threads when validating or doing checksums
+ * * `-r N`: Don't load the videos into memory. Have the decoder read them from
+ *   the file as it goes instead, one frame at a time through an `N` byte buffer
  */
 
 #define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "decoder.h"
 
@@ -23,8 +47,7 @@
  * \defgroup CONFIG
  * \brief Configuration parameters
  *
- * These really should be command-line arguments, but I just couldn't be
- * bothered to parse them.
+ * These are set from the command line. The values here are the defaults.
  * @{
  */
 
@@ -33,7 +56,7 @@
  *
  * This directory must exist.
  */
-const char *const OUT_DIR = "test-out";
+const char *OUT_DIR = "test-out";
 
 /**
  * \brief How many frames to skip between writes
@@ -41,7 +64,69 @@ const char *const OUT_DIR = "test-out";
  * This way, we don't write every frame as an image and take up a ton of disk
  * space.
  */
-const size_t OUT_INTERVAL = 30;
+size_t OUT_INTERVAL = 30;
+
+/**
+ * \brief How many times to decode the video when benchmarking
+ *
+ * If this is zero, we don't benchmark. We write images instead.
+ */
+size_t BENCH_RUNS = 0;
+
+/**
+ * \brief How many of the slowest frames to report when benchmarking
+ */
+size_t BENCH_WORST = 5;
+
+/**
+ * \brief Formats we can stream frames in
+ */
+typedef enum stream_format_t {
+  STREAM_NONE,
+  STREAM_RAW,
+  STREAM_Y4M,
+} stream_format_t;
+
+/**
+ * \brief What format to stream every frame in
+ *
+ * If this is `STREAM_NONE`, we write images every `OUT_INTERVAL` frames
+ * instead.
+ */
+stream_format_t STREAM_FORMAT = STREAM_NONE;
+
+/**
+ * \brief Where to stream frames to, or `-` for STDOUT
+ */
+const char *STREAM_FILE = "-";
+
+/**
+ * \brief File to write checksums to, or `NULL` for none
+ */
+const char *CHECKSUM_WRITE = NULL;
+
+/**
+ * \brief File to check checksums against, or `NULL` for none
+ */
+const char *CHECKSUM_VERIFY = NULL;
+
+/**
+ * \brief Whether to only check that the videos decode
+ */
+bool VALIDATE_ONLY = false;
+
+/**
+ * \brief How many threads to decode with when validating or doing checksums
+ */
+size_t THREADS = 1;
+
+/**
+ * \brief How big a buffer to read videos through, or zero to load them
+ *
+ * If this isn't zero, videos aren't loaded into memory. Instead, the decoder
+ * reads them from the file one frame at a time, through a buffer this big.
+ */
+size_t STAGING_LENGTH = 0;
 
 /** @} */
 
@@ -60,10 +145,18 @@ __attribute__((noreturn)) void die(const char *msg) {
  * This exists purely for us to read files with read_video(). We need to pass
  * the length information back to the main method somehow, and this is how we do
  * that.`
+ *
+ * If the video wasn't loaded, `data` is `NULL`, and `file` is where to read it
+ * from. Otherwise, `file` is `-1`.
+ *
+ * With `DECODER_ARENA`, `max_strips` is how many strips the decoder needs
+ * codebooks for. It's filled in by count_max_strips().
  */
 typedef struct buffer_t {
   void *data;
   size_t length;
+  int file;
+  size_t max_strips;
 } buffer_t;
 
 /**
@@ -73,11 +166,26 @@ typedef struct buffer_t {
  * Otherwise, it returns an allocated buffer containing the contents of the file
  * whose name was passed in.
  *
+ * If `STAGING_LENGTH` is set, the file is only opened, so it can be read by
+ * read_video_at() later.
+ *
  * \param[in] video_name The file to read from
  * \return A buffer representing the video
  */
 buffer_t read_video(const char *video_name) {
 
+  // Leave it in the file if we were asked to
+  if (STAGING_LENGTH != 0) {
+    buffer_t video = {.data = NULL, .file = open(video_name, O_RDONLY)};
+    if (video.file < 0)
+      die("failed to open video file");
+    struct stat video_stat;
+    if (fstat(video.file, &video_stat) != 0)
+      die("failed to get length of video file");
+    video.length = video_stat.st_size;
+    return video;
+  }
+
   // Open the file
   FILE *video_handle;
   {
@@ -87,7 +195,7 @@ buffer_t read_video(const char *video_name) {
   }
 
   // Get the file length
-  buffer_t video;
+  buffer_t video = {.file = -1};
   {
     int err;
     // Go to end
@@ -120,24 +228,249 @@ buffer_t read_video(const char *video_name) {
   return video;
 }
 
+/**
+ * \brief Read part of a video file for the decoder
+ *
+ * This is the callback passed to decoder_initialize_reader(). The context is
+ * the file descriptor. Since this uses pread(), several decoders can read the
+ * same file at once.
+ *
+ * If an error occurs, this method calls die() and exits.
+ */
+size_t read_video_at(void *context, void *buffer, size_t offset,
+                     size_t length) {
+  int file = (int)(intptr_t)context;
+  size_t done = 0;
+  while (done < length) {
+    ssize_t r = pread(file, (char *)buffer + done, length - done,
+                      (off_t)(offset + done));
+    if (r < 0)
+      die("failed to read video file");
+    if (r == 0)
+      break;
+    done += r;
+  }
+  return done;
+}
+
+/**
+ * \brief Memory a decoder needs besides itself
+ *
+ * The staging buffer is only allocated if `STAGING_LENGTH` is set. The arena
+ * and the framebuffer are only allocated with `DECODER_ARENA`. The arena has
+ * room for `DECODER_MAX_STRIPS` strips, so it fits every video, but the decoder
+ * is only told about as many as the video has.
+ */
+typedef struct decoder_buffers_t {
+  void *staging;
+  void *arena;
+  uint16_t *framebuffer;
+} decoder_buffers_t;
+
+/**
+ * \brief Allocate the memory for a decoder
+ *
+ * If an error occurs, this method calls die() and exits.
+ */
+decoder_buffers_t alloc_buffers(void) {
+  decoder_buffers_t r = {NULL, NULL, NULL};
+  if (STAGING_LENGTH != 0) {
+    r.staging = malloc(STAGING_LENGTH);
+    if (r.staging == NULL)
+      die("failed to allocate staging buffer");
+  }
+#ifdef DECODER_ARENA
+  r.arena = malloc(DECODER_ARENA_LENGTH(DECODER_MAX_STRIPS));
+  r.framebuffer = malloc(sizeof(uint16_t) * DECODER_OUTPUT_PIXELS);
+  if (r.arena == NULL || r.framebuffer == NULL)
+    die("failed to allocate decoder arena");
+#endif
+  return r;
+}
+
+/**
+ * \brief Free the memory from alloc_buffers()
+ */
+void free_buffers(decoder_buffers_t buffers) {
+  free(buffers.staging);
+  free(buffers.arena);
+  free(buffers.framebuffer);
+}
+
+/**
+ * \brief Point a decoder at a video from read_video()
+ *
+ * Videos that weren't loaded are read through `staging`, which must be
+ * `STAGING_LENGTH` bytes long. Otherwise, it's ignored.
+ *
+ * \param[out] d The decoder to initialize
+ * \param[in] video The video to decode
+ * \param[in] staging The staging buffer for this decoder
+ */
+void open_decoder(decoder_t *d, buffer_t video, void *staging) {
+  if (video.data == NULL)
+    decoder_initialize_reader(d, read_video_at, (void *)(intptr_t)video.file,
+                              staging, STAGING_LENGTH);
+  else
+    decoder_initialize(d, video.data, video.length);
+}
+
+#ifdef DECODER_ARENA
+/**
+ * \brief Find the most strips any frame of a video has
+ *
+ * This walks the frame headers the same way `mkindex` does. It stops at the
+ * first one it can't read, and decoding will report that later.
+ *
+ * \param[in] video The video to walk
+ * \param[in] staging A staging buffer, like for open_decoder()
+ * \return How many strips to size the arena for
+ */
+size_t count_max_strips(buffer_t video, void *staging) {
+  decoder_t d;
+  open_decoder(&d, video, staging);
+  size_t r = 0;
+  while (decoder_has_next_frame(&d)) {
+    decoder_frame_info_t info;
+    if (decoder_peek_frame(&d, &info) != SUCCESS ||
+        decoder_skip_frame(&d) != SUCCESS)
+      break;
+    if (info.strips > r)
+      r = info.strips;
+  }
+  return r < DECODER_MAX_STRIPS ? r : DECODER_MAX_STRIPS;
+}
+#endif
+
+/**
+ * \brief Initialize a decoder for a video from read_video()
+ *
+ * With `DECODER_ARENA`, the decoder is given the arena and framebuffer from
+ * `buffers`. The framebuffer is cleared first, just like the decoder would
+ * clear its own.
+ *
+ * \param[out] d The decoder to initialize
+ * \param[in] video The video to decode
+ * \param[in] buffers The memory for this decoder
+ */
+void start_decoder(decoder_t *d, buffer_t video,
+                   const decoder_buffers_t *buffers) {
+  open_decoder(d, video, buffers->staging);
+#ifdef DECODER_ARENA
+  decoder_set_arena(d, buffers->arena, video.max_strips);
+  memset(buffers->framebuffer, 0, sizeof(uint16_t) * DECODER_OUTPUT_PIXELS);
+  decoder_set_output(d, buffers->framebuffer);
+#endif
+}
+
+/**
+ * \defgroup CONVERT
+ * \brief Convert frames for output
+ *
+ * There are only 32768 colors, so we convert with lookup tables. Each entry
+ * holds a whole output pixel, with its first byte in the low bits. For RGB24,
+ * we store all four bytes of an entry and then move three bytes forward. This
+ * is faster than assembling the bytes one at a time, but it means the output
+ * needs a spare byte at the end.
+ *
+ * @{
+ */
+
+/**
+ * \brief Table from BGR555 to RGB888
+ */
+uint32_t bgr555_to_rgb888[1 << 15];
+
+/**
+ * \brief Table from BGR555 to full-range BT.601 YCbCr
+ */
+uint32_t bgr555_to_ycbcr[1 << 15];
+
+/**
+ * \brief Populate the conversion tables
+ *
+ * This must be called before converting any frames.
+ */
+void build_conversion_tables(void) {
+  for (uint32_t c = 0; c < (1 << 15); c++) {
+    // Expand to eight bits per channel
+    int r = ((c >> 0) & 0x1f) << 3;
+    int g = ((c >> 5) & 0x1f) << 3;
+    int b = ((c >> 10) & 0x1f) << 3;
+    bgr555_to_rgb888[c] = r | g << 8 | b << 16;
+    // Convert to YCbCr, rounding and biasing so everything is positive
+    int y = (77 * r + 150 * g + 29 * b + 128) >> 8;
+    int cb = (-43 * r - 85 * g + 128 * b + 32896) >> 8;
+    int cr = (128 * r - 107 * g - 21 * b + 32896) >> 8;
+    cb = cb > 255 ? 255 : cb;
+    cr = cr > 255 ? 255 : cr;
+    bgr555_to_ycbcr[c] = y | cb << 8 | cr << 16;
+  }
+}
+
+/**
+ * \brief Convert a frame to RGB888
+ *
+ * Only the top-left `width` by `height` pixels are converted, and they're
+ * packed with no gaps between rows.
+ *
+ * \param[in] frame The frame in BGR555
+ * \param[in] width How many pixels of each row to convert
+ * \param[in] height How many rows to convert
+ * \param[out] out Where to write, with room for `3 * DECODER_OUTPUT_PIXELS + 1`
+ */
+void convert_rgb888(const uint16_t *restrict frame, size_t width,
+                    size_t height, uint8_t *restrict out) {
+  for (size_t row = 0; row < height; row++) {
+    const uint16_t *line = frame + row * DECODER_OUTPUT_WIDTH;
+    for (size_t i = 0; i < width; i++) {
+      uint32_t c = bgr555_to_rgb888[line[i] & 0x7fff];
+      memcpy(out + 3 * (row * width + i), &c, sizeof(c));
+    }
+  }
+}
+
+/**
+ * \brief Convert a frame to planar YCbCr
+ * \see convert_rgb888()
+ * \param[out] out Where to write, with room for `3 * DECODER_OUTPUT_PIXELS`
+ */
+void convert_ycbcr(const uint16_t *restrict frame, size_t width,
+                   size_t height, uint8_t *restrict out) {
+  const size_t pixels = width * height;
+  uint8_t *const y = out;
+  uint8_t *const cb = out + pixels;
+  uint8_t *const cr = out + 2 * pixels;
+  for (size_t row = 0; row < height; row++) {
+    const uint16_t *line = frame + row * DECODER_OUTPUT_WIDTH;
+    for (size_t i = 0; i < width; i++) {
+      uint32_t c = bgr555_to_ycbcr[line[i] & 0x7fff];
+      y[row * width + i] = c >> 0;
+      cb[row * width + i] = c >> 8;
+      cr[row * width + i] = c >> 16;
+    }
+  }
+}
+
+/** @} */
+
 /**
  * \brief Write the data in the framebuffer to a file
  *
  * If an error occurs, this method calls die() and exits.
  *
  * \param[in] frame The frame to write in RGB555
+ * \param[in] width How wide the frame is, from decoder_get_dimensions()
+ * \param[in] height How tall the frame is
  * \param[in] frame_name The filename to write
  */
-void write_framebuffer(const uint16_t *frame, const char *frame_name) {
+void write_framebuffer(const uint16_t *frame, size_t width, size_t height,
+                       const char *frame_name) {
 
   // Variable to store the result of converting the frame to RGB888
-  static uint8_t frame_converted[3 * DECODER_PIXELS];
+  static uint8_t frame_converted[3 * DECODER_OUTPUT_PIXELS + 1];
   // Convert the frame
-  for (size_t i = 0; i < DECODER_PIXELS; i++) {
-    frame_converted[3 * i + 0] = ((frame[i] >> 0) & 0x1f) << 3;
-    frame_converted[3 * i + 1] = ((frame[i] >> 5) & 0x1f) << 3;
-    frame_converted[3 * i + 2] = ((frame[i] >> 10) & 0x1f) << 3;
-  }
+  convert_rgb888(frame, width, height, frame_converted);
 
   // Open the file
   FILE *frame_handle;
@@ -149,16 +482,15 @@ void write_framebuffer(const uint16_t *frame, const char *frame_name) {
 
   // Write the header
   {
-    int err =
-        fprintf(frame_handle, "P6 %d %d 255\n", DECODER_WIDTH, DECODER_HEIGHT);
+    int err = fprintf(frame_handle, "P6 %zu %zu 255\n", width, height);
     if (err < 0)
       die("failed to write header");
   }
 
   // Write the data
   {
-    size_t w = fwrite(frame_converted, 1, 3 * DECODER_PIXELS, frame_handle);
-    if (w != 3 * DECODER_PIXELS)
+    size_t w = fwrite(frame_converted, 1, 3 * width * height, frame_handle);
+    if (w != 3 * width * height)
       die("failed to write data");
   }
 
@@ -166,23 +498,229 @@ void write_framebuffer(const uint16_t *frame, const char *frame_name) {
   fclose(frame_handle);
 }
 
+/**
+ * \brief Open the stream to write frames to
+ *
+ * The stream's header, if it has one, is written with the first frame, since
+ * that's when the dimensions are known. If an error occurs, this method calls
+ * die() and exits.
+ *
+ * \return The handle for the stream
+ */
+FILE *open_stream(void) {
+
+  // Open the file
+  FILE *stream_handle;
+  {
+    stream_handle =
+        strcmp(STREAM_FILE, "-") == 0 ? stdout : fopen(STREAM_FILE, "w");
+    if (stream_handle == NULL)
+      die("failed to open stream for writing");
+  }
+
+  // Frames are big, so buffer a few at a time
+  if (setvbuf(stream_handle, NULL, _IOFBF, 1 << 20) != 0)
+    die("failed to set stream buffer");
+
+  return stream_handle;
+}
+
+/**
+ * \brief Write a frame to the stream
+ *
+ * If an error occurs, this method calls die() and exits.
+ *
+ * \param[in] stream_handle The stream from open_stream()
+ * \param[in] frame The frame to write in BGR555
+ * \param[in] width How wide the frame is, from decoder_get_dimensions()
+ * \param[in] height How tall the frame is
+ * \param[in] first Whether this is the first frame, which writes the header
+ */
+void write_stream(FILE *stream_handle, const uint16_t *frame, size_t width,
+                  size_t height, bool first) {
+
+  // Variable to store the result of converting the frame
+  static uint8_t frame_converted[3 * DECODER_OUTPUT_PIXELS + 1];
+
+  // Write the stream's header. Every frame has to be the same size as this one.
+  if (first && STREAM_FORMAT == STREAM_Y4M) {
+    int err = fprintf(stream_handle,
+                      "YUV4MPEG2 W%zu H%zu F15:1 Ip A1:1 C444 "
+                      "XCOLORRANGE=FULL\n",
+                      width, height);
+    if (err < 0)
+      die("failed to write stream header");
+  }
+
+  // Convert the frame, and write any header it needs
+  if (STREAM_FORMAT == STREAM_Y4M) {
+    convert_ycbcr(frame, width, height, frame_converted);
+    if (fputs("FRAME\n", stream_handle) < 0)
+      die("failed to write frame header");
+  } else {
+    convert_rgb888(frame, width, height, frame_converted);
+  }
+
+  // Write the data
+  size_t w = fwrite(frame_converted, 1, 3 * width * height, stream_handle);
+  if (w != 3 * width * height)
+    die("failed to write data");
+}
+
+/**
+ * \brief Hash a row of blocks in a frame
+ *
+ * This is FNV-1a, but taken 64 bits at a time for speed. Each step is
+ * invertible, so any single changed word changes the hash before it's folded
+ * down to 32 bits.
+ *
+ * Only the first `width` pixels of each line are hashed. At full width, that's
+ * the same as hashing the whole row in one go.
+ *
+ * \param[in] frame The frame to hash
+ * \param[in] row Which of the `DECODER_BLOCK_ROWS` rows to hash
+ * \param[in] width How wide the frame is, which is a multiple of four
+ * \return The hash of the row
+ */
+uint32_t hash_block_row(const uint16_t *frame, size_t row, size_t width) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t line = 4 * row; line < 4 * row + 4; line++) {
+    const unsigned char *data =
+        (const unsigned char *)(frame + line * DECODER_WIDTH);
+    for (size_t i = 0; i < width * sizeof(uint16_t); i += 8) {
+      uint64_t w;
+      memcpy(&w, data + i, sizeof(w));
+      h = (h ^ w) * 0x00000100000001b3;
+    }
+  }
+  return h ^ (h >> 32);
+}
+
+#ifdef DECODER_UPSCALE
+/**
+ * \brief Undo the decoder's scaling, checking it along the way
+ *
+ * Every pixel should have been written as a 2x2 square. Taking one pixel from
+ * each gives the frame a build without `DECODER_UPSCALE` would have decoded, so
+ * checksums can be checked against either.
+ *
+ * \param[in] frame The frame from the decoder
+ * \param[in] width How wide the frame is before scaling
+ * \param[in] height How tall the frame is before scaling
+ * \param[out] out Where to write, with rows `DECODER_WIDTH` apart
+ * \return Whether every square was a single color
+ */
+bool unscale_frame(const uint16_t *restrict frame, size_t width, size_t height,
+                   uint16_t *restrict out) {
+  for (size_t y = 0; y < height; y++) {
+    const uint16_t *top = frame + 2 * y * DECODER_OUTPUT_WIDTH;
+    const uint16_t *bottom = top + DECODER_OUTPUT_WIDTH;
+    for (size_t x = 0; x < width; x++) {
+      const uint16_t c = top[2 * x];
+      if (top[2 * x + 1] != c || bottom[2 * x] != c || bottom[2 * x + 1] != c)
+        return false;
+      out[y * DECODER_WIDTH + x] = c;
+    }
+  }
+  return true;
+}
+#endif
+
+/**
+ * \brief Reference conversion from CVID YUV to BGR555
+ *
+ * This is the straightforward arithmetic version. The decoder may implement
+ * the conversion differently, such as with `DECODER_YUV_LUT`, but it must agree
+ * with this.
+ */
+uint16_t reference_yuv_to_bgr555(uint8_t y, int8_t u, int8_t v) {
+  // Do the matrix multiplication
+  int rp = y + v * 2;
+  int gp = y - u / 2 - v * 1;
+  int bp = y + u * 2;
+  // Clip to range
+  int rc = rp < 0 ? 0 : rp > 255 ? 255 : rp;
+  int gc = gp < 0 ? 0 : gp > 255 ? 255 : gp;
+  int bc = bp < 0 ? 0 : bp > 255 ? 255 : bp;
+  // Downsample, assemble, and return
+  return ((bc >> 3) << 10) | ((gc >> 3) << 5) | ((rc >> 3) << 0);
+}
+
+/**
+ * \brief Check the decoder's color conversion against the reference
+ *
+ * This checks every possible input. If any of them differ, this method calls
+ * die() and exits.
+ */
+void check_yuv_to_bgr555(void) {
+  for (int y = 0; y < 256; y++) {
+    for (int u = -128; u < 128; u++) {
+      for (int v = -128; v < 128; v++) {
+        if (decoder_yuv_to_bgr555(y, u, v) != reference_yuv_to_bgr555(y, u, v))
+          die("color conversion differs from reference");
+      }
+    }
+  }
+}
+
+/**
+ * \brief Parse a count from the command line
+ *
+ * If the argument isn't a positive number, this method calls die() and exits.
+ *
+ * \param[in] arg The argument to parse
+ * \return The count
+ */
+size_t parse_count(const char *arg) {
+  char *end;
+  unsigned long long r = strtoull(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || r == 0)
+    die("expected a positive number");
+  return r;
+}
+
+/**
+ * \brief Get the current time in nanoseconds
+ *
+ * This uses a monotonic clock, so it's only useful for measuring intervals.
+ */
+uint64_t now_ns(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    die("failed to read clock");
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * \brief Compare two times for qsort()
+ */
+int compare_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
 /**
  * \brief Global decoder for cinepak
  */
 decoder_t decoder;
 
-int main(int argc, char **argv) {
-
-  // We expect exactly one argument
-  if (argc != 2)
-    die("need exactly one argument");
+/**
+ * \brief Memory for the global decoder
+ */
+decoder_buffers_t decoder_buffers;
 
-  // Read in the video
-  buffer_t video = read_video(argv[1]);
-  printf("Successfully read %s (%zu bytes)\n", argv[1], video.length);
+/**
+ * \brief Decode the video, writing out frames as we go
+ *
+ * If an error occurs, this method calls die() and exits.
+ *
+ * \param[in] video The video to decode
+ */
+void run_test(buffer_t video) {
 
   // Initialize the decoder
-  decoder_initialize(&decoder, video.data, video.length);
+  start_decoder(&decoder, video, &decoder_buffers);
   printf("Successfully initialized decoder\n");
 
   // Get frames
@@ -201,8 +739,10 @@ int main(int argc, char **argv) {
         die("failed to allocate filename");
       // Get the framebuffer to write
       const uint16_t *fb = decoder_get_framebuffer(&decoder);
+      size_t width, height;
+      decoder_get_dimensions(&decoder, &width, &height);
       // Write it
-      write_framebuffer(fb, fn);
+      write_framebuffer(fb, width, height, fn);
       // Done
       free(fn);
       printf("Successfully wrote frame %zu\n", i);
@@ -211,7 +751,772 @@ int main(int argc, char **argv) {
     // Remember to increment
     i++;
   }
+}
+
+/**
+ * \brief Decode the video, writing every frame to the stream
+ *
+ * If an error occurs, this method calls die() and exits.
+ *
+ * \param[in] video The video to decode
+ * \param[in] status Where to print progress, since the stream may be STDOUT
+ */
+void run_stream(buffer_t video, FILE *status) {
+
+  // Initialize the decoder
+  start_decoder(&decoder, video, &decoder_buffers);
+  fprintf(status, "Successfully initialized decoder\n");
+
+  // Get frames
+  FILE *stream_handle = open_stream();
+  size_t i = 0;
+  while (decoder_has_next_frame(&decoder)) {
+    // Decode the frame and handle the result
+    decoder_status_t r = decoder_compute_frame(&decoder);
+    if (r != SUCCESS)
+      die("got error after decoding");
+    // Write it
+    size_t width, height;
+    decoder_get_dimensions(&decoder, &width, &height);
+    write_stream(stream_handle, decoder_get_framebuffer(&decoder), width,
+                 height, i == 0);
+    i++;
+  }
 
   // Done
-  free(video.data);
+  if (fclose(stream_handle) != 0)
+    die("failed to close stream");
+  fprintf(status, "Successfully wrote %zu frames\n", i);
+}
+
+/**
+ * \defgroup PARALLEL
+ * \brief Decode a whole video, possibly on several threads
+ *
+ * A keyframe doesn't depend on the frames before it, as long as it rebuilds
+ * every codebook entry it uses and covers the whole screen. Encoders usually do
+ * that. So, we split the video at its keyframes, and each thread decodes
+ * segments with its own decoder. What we need from each frame is kept, so it
+ * can be reported in order afterward, just like a serial run would.
+ *
+ * Not every video can be split like that, so every segment is checked. It's
+ * decoded from the keyframe twice, once from zeroed codebooks and framebuffer
+ * and once from filled ones, until both decoders hold the same state. If a
+ * frame comes out differently before then, the segment depends on the frames
+ * before it. Then, it's decoded again straight through from the segment before
+ * it, which gives the same results as a serial run.
+ *
+ * With one thread, the video is decoded straight through without splitting.
+ *
+ * @{
+ */
+
+/**
+ * \brief What we keep from decoding a single frame
+ */
+typedef struct frame_result_t {
+  decoder_status_t status;
+  uint16_t strips;
+  decoder_strip_t strip_data[DECODER_MAX_STRIPS];
+  uint16_t rows;
+  uint32_t hashes[DECODER_BLOCK_ROWS];
+} frame_result_t;
+
+/**
+ * \brief The results of decoding a whole video
+ *
+ * Decoding stops at the first error, so the frames after one have no result.
+ * The last result may be for a frame whose header couldn't be read.
+ */
+typedef struct video_result_t {
+  frame_result_t *frames;
+  size_t length;
+} video_result_t;
+
+/**
+ * \brief A run of frames for one thread to decode
+ *
+ * Every segment but the first starts at a keyframe. `dependent` says whether
+ * checking it showed that it depends on the frames before it, in which case
+ * its results can't be used.
+ */
+typedef struct segment_t {
+  size_t start;
+  size_t end;
+  bool dependent;
+} segment_t;
+
+/**
+ * \brief Work shared between the threads decoding a video
+ *
+ * `strips` is the most strips any frame has, which is how many strips'
+ * codebooks can affect the frames we decode.
+ */
+typedef struct parallel_work_t {
+  buffer_t video;
+  decoder_frame_info_t *index;
+  frame_result_t *results;
+  size_t strips;
+  segment_t *segments;
+  size_t segments_length;
+  atomic_size_t next_segment;
+} parallel_work_t;
+
+/**
+ * \brief Decode the next frame with a decoder, keeping the result
+ * \param[inout] d The decoder, positioned at the frame
+ * \param[out] result Where to write the result for the frame
+ * \return Whether the frame decoded successfully
+ */
+bool decode_frame(decoder_t *d, frame_result_t *result) {
+  // Remember how many strips there are, then decode the frame
+  decoder_frame_info_t info;
+  result->status = decoder_peek_frame(d, &info);
+  if (result->status == SUCCESS)
+    result->status = decoder_compute_frame(d);
+  if (result->status != SUCCESS)
+    return false;
+  // Keep what we need
+  result->strips = info.strips;
+  memcpy(result->strip_data, d->strips, sizeof(result->strip_data));
+  const uint16_t *fb = decoder_get_framebuffer(d);
+  size_t width, height;
+  decoder_get_dimensions(d, &width, &height);
+#ifdef DECODER_UPSCALE
+  // Hash the frame as it was before scaling, so the checksums are the same as
+  // for any other build
+  static _Thread_local uint16_t unscaled[DECODER_PIXELS];
+  width /= DECODER_SCALE;
+  height /= DECODER_SCALE;
+  if (!unscale_frame(fb, width, height, unscaled))
+    die("frame wasn't scaled up evenly");
+  fb = unscaled;
+#endif
+  result->rows = height / 4;
+  for (size_t row = 0; row < result->rows; row++)
+    result->hashes[row] = hash_block_row(fb, row, width);
+  return true;
+}
+
+/**
+ * \brief Decode frames with a decoder, keeping the results
+ *
+ * This stops early if there's an error.
+ *
+ * \param[inout] d The decoder, positioned at the first frame
+ * \param[out] results Where to write the result for each frame
+ * \param[in] frames How many frames to decode
+ */
+void decode_frames(decoder_t *d, frame_result_t *results, size_t frames) {
+  for (size_t i = 0; i < frames; i++) {
+    if (!decode_frame(d, results + i))
+      return;
+  }
+}
+
+/**
+ * \brief Fill a freshly started decoder's codebooks and framebuffer
+ *
+ * start_decoder() leaves them zeroed, or clears them as the first frame is
+ * decoded. Decoding from both tells us what depends on them.
+ *
+ * \param[inout] d The decoder, straight from start_decoder()
+ * \param[in] buffers The memory `d` was started with
+ */
+void fill_decoder(decoder_t *d, const decoder_buffers_t *buffers) {
+  // Every strip shares the first codebooks at the start
+  if (d->max_strips != 0) {
+    memset(d->v4_books[0], 0xa5, sizeof(d->v4_books[0]));
+    memset(d->v1_books[0], 0xa5, sizeof(d->v1_books[0]));
+  }
+#ifdef DECODER_ARENA
+  uint16_t *framebuffer = buffers->framebuffer;
+#else
+  // Don't let the first frame clear it
+  (void)buffers;
+  uint16_t *framebuffer = d->framebuffer;
+  d->clear_pending = false;
+#endif
+  memset(framebuffer, 0xa5, sizeof(uint16_t) * DECODER_OUTPUT_PIXELS);
+}
+
+/**
+ * \brief Check whether two decoders will decode the rest of a video the same
+ * \param[in] a One decoder
+ * \param[in] b The other decoder, at the same place in the same video
+ * \param[in] strips How many strips' codebooks can still be used
+ */
+bool same_state(const decoder_t *a, const decoder_t *b, size_t strips) {
+  for (size_t i = 0; i < strips; i++) {
+    const decoder_strip_t *sa = a->strips + i;
+    const decoder_strip_t *sb = b->strips + i;
+    if (memcmp(sa->v4, sb->v4, sizeof(a->v4_books[0])) != 0 ||
+        memcmp(sa->v1, sb->v1, sizeof(a->v1_books[0])) != 0)
+      return false;
+  }
+  return memcmp(decoder_get_framebuffer(a), decoder_get_framebuffer(b),
+                sizeof(uint16_t) * DECODER_OUTPUT_PIXELS) == 0;
+}
+
+/**
+ * \brief Check whether two results for a frame would be reported the same
+ *
+ * The strips aren't compared, since they point into each decoder's own
+ * codebooks. They're laid out by the frame's data alone.
+ */
+bool same_result(const frame_result_t *a, const frame_result_t *b) {
+  if (a->status != b->status)
+    return false;
+  if (a->status != SUCCESS)
+    return true;
+  return a->rows == b->rows &&
+         memcmp(a->hashes, b->hashes, sizeof(uint32_t) * a->rows) == 0;
+}
+
+/**
+ * \brief Decode the start of a segment, checking it doesn't depend on what
+ * came before it
+ *
+ * Both decoders decode frames until they hold the same state, and the results
+ * from `d` are kept. After that, the rest of the segment can't differ.
+ *
+ * \param[inout] d The decoder, positioned at the segment's keyframe
+ * \param[inout] check A decoder filled with fill_decoder(), also positioned at
+ * the segment's keyframe
+ * \param[in] work The work the segment is from
+ * \param[inout] segment The segment to check, which is marked if it's
+ * dependent
+ * \return How many frames were decoded, or the whole segment if it's dependent
+ * or there was an error
+ */
+size_t check_segment(decoder_t *d, decoder_t *check,
+                     const parallel_work_t *work, segment_t *segment) {
+  const size_t frames = segment->end - segment->start;
+  frame_result_t *results = work->results + segment->start;
+  for (size_t i = 0; i < frames; i++) {
+    frame_result_t other;
+    bool ok = decode_frame(d, results + i);
+    decode_frame(check, &other);
+    if (!same_result(results + i, &other)) {
+      segment->dependent = true;
+      return frames;
+    }
+    if (!ok)
+      return frames;
+    if (same_state(d, check, work->strips))
+      return i + 1;
+  }
+  return frames;
+}
+
+/**
+ * \brief Thread entry point for decoding segments
+ *
+ * Threads pull segments until there are none left.
+ *
+ * \param[inout] arg The shared `parallel_work_t`
+ */
+void *decode_segments(void *arg) {
+  parallel_work_t *work = arg;
+
+  // Every thread gets its own decoder, and another to check segments with
+  decoder_t *d = malloc(sizeof(decoder_t));
+  decoder_t *check = malloc(sizeof(decoder_t));
+  if (d == NULL || check == NULL)
+    die("failed to allocate decoder");
+  decoder_buffers_t buffers = alloc_buffers();
+  decoder_buffers_t check_buffers = alloc_buffers();
+
+  for (;;) {
+    size_t i = atomic_fetch_add(&work->next_segment, 1);
+    if (i >= work->segments_length)
+      break;
+    segment_t *segment = work->segments + i;
+    frame_result_t *results = work->results + segment->start;
+    const size_t frames = segment->end - segment->start;
+
+    // The first segment starts at the start of the video, whatever kind of
+    // frame is there. Nothing comes before it.
+    start_decoder(d, work->video, &buffers);
+    if (segment->start == 0) {
+      decode_frames(d, results, frames);
+      continue;
+    }
+
+    // Start fresh at the keyframe, and check the segment from there
+    start_decoder(check, work->video, &check_buffers);
+    fill_decoder(check, &check_buffers);
+    results->status = decoder_seek_keyframe(d, work->index + segment->start);
+    if (results->status != SUCCESS)
+      continue;
+    if (decoder_seek_keyframe(check, work->index + segment->start) != SUCCESS)
+      die("failed to seek the same way twice");
+    size_t checked = check_segment(d, check, work, segment);
+    decode_frames(d, results + checked, frames - checked);
+  }
+
+  free_buffers(check_buffers);
+  free_buffers(buffers);
+  free(check);
+  free(d);
+  return NULL;
+}
+
+/**
+ * \brief Decode segments on `THREADS` threads
+ *
+ * If something goes wrong with the threads, this method calls die() and exits.
+ *
+ * \param[inout] work The segments to decode, with `next_segment` at zero
+ */
+void run_segments(parallel_work_t *work) {
+  pthread_t *threads = malloc(sizeof(pthread_t) * THREADS);
+  if (threads == NULL)
+    die("failed to allocate threads");
+  for (size_t i = 0; i < THREADS; i++) {
+    if (pthread_create(threads + i, NULL, decode_segments, work) != 0)
+      die("failed to create thread");
+  }
+  for (size_t i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+/**
+ * \brief Decode a whole video on `THREADS` threads
+ *
+ * If something other than the video goes wrong, this method calls die() and
+ * exits.
+ *
+ * \param[in] video The video to decode
+ * \return The results for every frame, to be freed by the caller
+ */
+video_result_t decode_video(buffer_t video) {
+
+  // Find every frame. If a header is bad, the frames before it can still be
+  // decoded.
+  start_decoder(&decoder, video, &decoder_buffers);
+  size_t frames = 0;
+  size_t capacity = video.length / DECODER_FRAME_HEADER + 1;
+  decoder_frame_info_t *index = malloc(sizeof(decoder_frame_info_t) * capacity);
+  if (index == NULL)
+    die("failed to allocate frame index");
+  decoder_status_t index_status = SUCCESS;
+  while (decoder_has_next_frame(&decoder)) {
+    index_status = decoder_peek_frame(&decoder, index + frames);
+    if (index_status != SUCCESS)
+      break;
+    decoder_skip_frame(&decoder);
+    frames++;
+  }
+
+  // Allocate results. Every frame starts out undecoded.
+  video_result_t result;
+  result.length = frames + (index_status != SUCCESS);
+  result.frames = calloc(result.length + 1, sizeof(frame_result_t));
+  if (result.frames == NULL)
+    die("failed to allocate results");
+  for (size_t i = 0; i < result.length; i++)
+    result.frames[i].status = ERROR_INTERNAL;
+  if (index_status != SUCCESS)
+    result.frames[frames].status = index_status;
+
+  if (THREADS == 1) {
+    // Just decode straight through
+    start_decoder(&decoder, video, &decoder_buffers);
+    decode_frames(&decoder, result.frames, frames);
+
+  } else {
+    // Split at keyframes. The first segment always starts at the first frame,
+    // so a video that doesn't start with a keyframe fails like it would
+    // serially.
+    parallel_work_t work = {
+        .video = video,
+        .index = index,
+        .results = result.frames,
+        .strips = 0,
+        .segments = malloc(sizeof(segment_t) * (frames + 1)),
+        .segments_length = 0,
+    };
+    if (work.segments == NULL)
+      die("failed to allocate segments");
+    for (size_t i = 0; i < frames; i++) {
+      if (i == 0 || index[i].keyframe) {
+        if (work.segments_length != 0)
+          work.segments[work.segments_length - 1].end = i;
+        work.segments[work.segments_length++] =
+            (segment_t){.start = i, .end = frames, .dependent = false};
+      }
+      if (index[i].strips > work.strips)
+        work.strips = index[i].strips;
+    }
+    if (work.strips > DECODER_MAX_STRIPS)
+      work.strips = DECODER_MAX_STRIPS;
+    atomic_init(&work.next_segment, 0);
+    run_segments(&work);
+
+    // Join every dependent segment onto the one before it, and decode just
+    // the joined segments again. The first segment is never dependent.
+    size_t redo = 0;
+    for (size_t i = 0; i < work.segments_length; i++) {
+      const segment_t *segment = work.segments + i;
+      if (segment->dependent)
+        work.segments[redo - 1].end = segment->end;
+      else if (i + 1 < work.segments_length && segment[1].dependent)
+        work.segments[redo++] = *segment;
+    }
+    if (redo != 0) {
+      work.segments_length = redo;
+      atomic_init(&work.next_segment, 0);
+      run_segments(&work);
+    }
+    free(work.segments);
+  }
+
+  // Decoding stops at the first error, so cut the results off there
+  for (size_t i = 0; i < result.length; i++) {
+    if (result.frames[i].status != SUCCESS) {
+      result.length = i + 1;
+      break;
+    }
+  }
+
+  free(index);
+  return result;
+}
+
+/** @} */
+
+/**
+ * \brief Describe a decoder error for the user
+ */
+const char *describe_status(decoder_status_t status) {
+  switch (status) {
+  case SUCCESS:
+    return "success";
+  case ERROR_EOF:
+    return "unexpected end of data";
+  case ERROR_INVALID_DATA:
+    return "invalid data";
+  case ERROR_BAD_DIMENSIONS:
+    return "bad dimensions";
+  case ERROR_INTERNAL:
+    return "internal error";
+  }
+  return "unknown error";
+}
+
+/**
+ * \brief Check that a video decodes without errors
+ * \param[in] video The video to decode
+ * \param[in] video_name What to call the video when reporting
+ * \return Whether the video decoded successfully
+ */
+bool run_validate(buffer_t video, const char *video_name) {
+  video_result_t result = decode_video(video);
+  bool ok = true;
+  for (size_t i = 0; i < result.length; i++) {
+    if (result.frames[i].status != SUCCESS) {
+      printf("%s: frame %zu: %s\n", video_name, i,
+             describe_status(result.frames[i].status));
+      ok = false;
+    }
+  }
+  if (ok)
+    printf("Successfully validated %s (%zu frames)\n", video_name,
+           result.length);
+  free(result.frames);
+  return ok;
+}
+
+/**
+ * \brief Tell the user where a frame differs from its checksum
+ *
+ * We only have hashes, so the best we can do is the first row of blocks that
+ * differs. We also say which of the frame's strips covers it.
+ *
+ * \param[in] frame The number of the frame that differs
+ * \param[in] row The first row of blocks that differs
+ * \param[in] result What we kept from decoding the frame
+ */
+void report_difference(size_t frame, size_t row, const frame_result_t *result) {
+  printf("Frame %zu differs first in block row %zu (lines %zu to %zu)\n", frame,
+         row, 4 * row, 4 * row + 3);
+  for (size_t i = 0; i < result->strips; i++) {
+    const decoder_strip_t *strip = result->strip_data + i;
+    if (strip->y0 <= 4 * row && 4 * row < strip->y1) {
+      printf("That's in strip %zu, covering lines %u to %u and columns %u to "
+             "%u\n",
+             i, strip->y0, strip->y1 - 1, strip->x0, strip->x1 - 1);
+      return;
+    }
+  }
+  printf("No strip in that frame covers it, so it's left over from before\n");
+}
+
+/**
+ * \brief Decode the video, writing or checking a checksum for every frame
+ *
+ * The file has one line per frame. Each line has the frame number, then the
+ * hash of each row of blocks in hexadecimal. Several videos just follow each
+ * other in the same file.
+ *
+ * If an error occurs, or if a frame differs, this method calls die() and exits.
+ *
+ * \param[in] video The video to decode
+ * \param[in] checksum_handle The file to write to or read from
+ */
+void run_checksum(buffer_t video, FILE *checksum_handle) {
+
+  bool verify = CHECKSUM_VERIFY != NULL;
+  video_result_t result = decode_video(video);
+
+  for (size_t i = 0; i < result.length; i++) {
+    const frame_result_t *frame_result = result.frames + i;
+    if (frame_result->status != SUCCESS)
+      die("got error after decoding");
+
+    if (!verify) {
+      // Write the line
+      fprintf(checksum_handle, "%zu", i);
+      for (size_t row = 0; row < frame_result->rows; row++)
+        fprintf(checksum_handle, " %08x",
+                (unsigned int)frame_result->hashes[row]);
+      if (fputc('\n', checksum_handle) == EOF)
+        die("failed to write checksum");
+
+    } else {
+      // Read the line and compare
+      size_t frame;
+      if (fscanf(checksum_handle, "%zu", &frame) != 1)
+        die("checksum file has fewer frames than the video");
+      if (frame != i)
+        die("checksum file is out of order");
+      for (size_t row = 0; row < frame_result->rows; row++) {
+        unsigned int expected;
+        if (fscanf(checksum_handle, " %x", &expected) != 1)
+          die("checksum file is malformed");
+        if (expected != frame_result->hashes[row]) {
+          report_difference(i, row, frame_result);
+          die("frame differs from checksum");
+        }
+      }
+    }
+  }
+
+  // Done
+  printf("Successfully %s %zu checksums\n", verify ? "checked" : "wrote",
+         result.length);
+  free(result.frames);
+}
+
+/**
+ * \brief Decode the video `BENCH_RUNS` times, and report how long it took
+ *
+ * Percentiles are taken over every frame of every run. A frame's cost is the
+ * fastest it was decoded in any run, since anything slower is noise from the
+ * host. The slowest frames are ranked by that.
+ *
+ * If an error occurs, this method calls die() and exits.
+ *
+ * \param[in] video The video to decode
+ */
+void run_benchmark(buffer_t video) {
+
+  // Count the frames so we know how much to allocate
+  size_t frames = 0;
+  start_decoder(&decoder, video, &decoder_buffers);
+  while (decoder_has_next_frame(&decoder)) {
+    if (decoder_skip_frame(&decoder) != SUCCESS)
+      die("got error skipping frame");
+    frames++;
+  }
+  if (frames == 0)
+    die("video has no frames");
+
+  // Allocate space for the times. We keep every sample, as well as the best
+  // for every frame.
+  uint64_t *samples = malloc(sizeof(uint64_t) * frames * BENCH_RUNS);
+  uint64_t *best = malloc(sizeof(uint64_t) * frames);
+  if (samples == NULL || best == NULL)
+    die("failed to allocate benchmark buffers");
+  for (size_t i = 0; i < frames; i++)
+    best[i] = UINT64_MAX;
+
+  // Do the runs
+  uint64_t total = 0;
+  for (size_t run = 0; run < BENCH_RUNS; run++) {
+    start_decoder(&decoder, video, &decoder_buffers);
+    for (size_t i = 0; i < frames; i++) {
+      uint64_t start = now_ns();
+      decoder_status_t r = decoder_compute_frame(&decoder);
+      uint64_t t = now_ns() - start;
+      if (r != SUCCESS)
+        die("got error after decoding");
+      samples[run * frames + i] = t;
+      if (t < best[i])
+        best[i] = t;
+      total += t;
+    }
+  }
+
+  // Report the overall speed
+  size_t count = frames * BENCH_RUNS;
+  printf("Decoded %zu frames %zu times\n", frames, BENCH_RUNS);
+  printf("%.0f ns/frame, %.1f frames/s\n", (double)total / count,
+         count * 1e9 / total);
+
+  // Report the distribution
+  qsort(samples, count, sizeof(uint64_t), compare_ns);
+  printf("p50 %llu ns, p99 %llu ns, max %llu ns\n",
+         (unsigned long long)samples[(count - 1) / 2],
+         (unsigned long long)samples[(count - 1) * 99 / 100],
+         (unsigned long long)samples[count - 1]);
+
+  // Report the worst frames. There aren't many, so just pick them out one at a
+  // time.
+  size_t worst = BENCH_WORST < frames ? BENCH_WORST : frames;
+  for (size_t k = 0; k < worst; k++) {
+    size_t w = 0;
+    for (size_t i = 1; i < frames; i++) {
+      if (best[i] != UINT64_MAX && (best[w] == UINT64_MAX || best[i] > best[w]))
+        w = i;
+    }
+    printf("Slow frame %zu: %llu ns\n", w, (unsigned long long)best[w]);
+    best[w] = UINT64_MAX;
+  }
+
+  // Done
+  free(samples);
+  free(best);
+}
+
+int main(int argc, char **argv) {
+
+  // Parse options
+  int opt;
+  while ((opt = getopt(argc, argv, "o:i:b:w:s:f:c:v:nj:r:")) != -1) {
+    switch (opt) {
+    case 'o':
+      OUT_DIR = optarg;
+      break;
+    case 'i':
+      OUT_INTERVAL = parse_count(optarg);
+      break;
+    case 'b':
+      BENCH_RUNS = parse_count(optarg);
+      break;
+    case 'w':
+      BENCH_WORST = parse_count(optarg);
+      break;
+    case 's':
+      if (strcmp(optarg, "raw") == 0)
+        STREAM_FORMAT = STREAM_RAW;
+      else if (strcmp(optarg, "y4m") == 0)
+        STREAM_FORMAT = STREAM_Y4M;
+      else
+        die("stream format must be raw or y4m");
+      break;
+    case 'f':
+      STREAM_FILE = optarg;
+      break;
+    case 'c':
+      CHECKSUM_WRITE = optarg;
+      break;
+    case 'v':
+      CHECKSUM_VERIFY = optarg;
+      break;
+    case 'n':
+      VALIDATE_ONLY = true;
+      break;
+    case 'j':
+      THREADS = parse_count(optarg);
+      break;
+    case 'r':
+      STAGING_LENGTH = parse_count(optarg);
+      break;
+    default:
+      die("usage: video-demo-test [-o dir] [-i interval] [-b runs] [-w worst] "
+          "[-s format] [-f file] [-c checksums] [-v checksums] [-n] "
+          "[-j threads] [-r staging] video.cvid...");
+    }
+  }
+  bool checksum = CHECKSUM_WRITE != NULL || CHECKSUM_VERIFY != NULL;
+  if ((BENCH_RUNS != 0) + (STREAM_FORMAT != STREAM_NONE) +
+          (CHECKSUM_WRITE != NULL) + (CHECKSUM_VERIFY != NULL) +
+          VALIDATE_ONLY >
+      1)
+    die("can only do one of benchmarking, streaming, validating, and "
+        "checksums");
+
+  // Don't mix progress into a stream on STDOUT
+  FILE *status = STREAM_FORMAT != STREAM_NONE && strcmp(STREAM_FILE, "-") == 0
+                     ? stderr
+                     : stdout;
+
+  // We expect at least one file, and only one unless we're validating
+  if (argc - optind < 1)
+    die("need a video file");
+  if (argc - optind > 1 && !VALIDATE_ONLY && !checksum)
+    die("can only take several video files when validating or doing checksums");
+
+  // Make sure the color conversion is right before we rely on it
+  check_yuv_to_bgr555();
+  fprintf(status, "Successfully checked color conversion\n");
+  build_conversion_tables();
+
+  // The global decoder only needs one set of buffers for every video
+  decoder_buffers = alloc_buffers();
+
+  // Every video shares the same checksum file
+  FILE *checksum_handle = NULL;
+  if (checksum) {
+    checksum_handle = CHECKSUM_VERIFY != NULL ? fopen(CHECKSUM_VERIFY, "r")
+                                              : fopen(CHECKSUM_WRITE, "w");
+    if (checksum_handle == NULL)
+      die("failed to open checksum file");
+  }
+
+  bool ok = true;
+  for (int arg = optind; arg < argc; arg++) {
+    const char *video_name = argv[arg];
+
+    // Read in the video
+    buffer_t video = read_video(video_name);
+    fprintf(status, "Successfully %s %s (%zu bytes)\n",
+            video.data != NULL ? "read" : "opened", video_name, video.length);
+#ifdef DECODER_ARENA
+    video.max_strips = count_max_strips(video, decoder_buffers.staging);
+    fprintf(status, "Sized decoder arena for %zu strips\n", video.max_strips);
+#endif
+
+    // Do what we were asked
+    if (BENCH_RUNS != 0)
+      run_benchmark(video);
+    else if (STREAM_FORMAT != STREAM_NONE)
+      run_stream(video, status);
+    else if (checksum)
+      run_checksum(video, checksum_handle);
+    else if (VALIDATE_ONLY)
+      ok &= run_validate(video, video_name);
+    else
+      run_test(video);
+
+    // Done
+    free(video.data);
+    if (video.file >= 0)
+      close(video.file);
+  }
+  free_buffers(decoder_buffers);
+
+  // Make sure the checksums covered everything
+  if (checksum) {
+    size_t frame;
+    if (CHECKSUM_VERIFY != NULL && fscanf(checksum_handle, "%zu", &frame) == 1)
+      die("checksum file has more frames than the videos");
+    if (fclose(checksum_handle) != 0)
+      die("failed to close checksum file");
+  }
+
+  return ok ? 0 : 1;
 }
@@ -3,25 +3,59 @@
 # See: test.c
 
 CC = cc
+
+CDEFS = -DDECODER_VALIDATE
+
 CFLAGS = \
-	-DDECODER_VALIDATE \
-	-g -O2 \
+	$(CDEFS) \
+	-g -O2 -pthread \
 	-Wall -Wextra
-LDFLAGS =
+LDFLAGS = -pthread
 LFLAGS =
 
+# The same harness, but with validation compiled out of the decoder. This is
+# for measuring how much validation costs, so only run it on known-good data.
+CFLAGS_NOVALIDATE = $(filter-out -DDECODER_VALIDATE,$(CFLAGS))
+
 EFILE = video-demo-test
 OFILES = test.o decoder.o
+EFILE_NOVALIDATE = video-demo-test-novalidate
+OFILES_NOVALIDATE = test-novalidate.o decoder-novalidate.o
 
 .PHONY: all
-all: $(EFILE)
+all: $(EFILE) $(EFILE_NOVALIDATE)
 
 .PHONY: clean
 clean:
-	rm -fv $(EFILE) $(OFILES)
+	rm -fv $(EFILE) $(OFILES) $(EFILE_NOVALIDATE) $(OFILES_NOVALIDATE) mknative \
+		mknormal video-demo-cost
 
 $(EFILE): $(OFILES)
 	$(CC) $(LDFLAGS) -o $@ $^ $(LFLAGS)
 
+$(EFILE_NOVALIDATE): $(OFILES_NOVALIDATE)
+	$(CC) $(LDFLAGS) -o $@ $^ $(LFLAGS)
+
+# The transcoder always reads CVID, whatever the harness is built for. It does
+# have to agree on the dimensions, though.
+DIMENSIONS = $(filter -DDECODER_WIDTH=% -DDECODER_HEIGHT=%,$(CDEFS))
+mknative: mknative.c decoder.c decoder.h
+	$(CC) -DDECODER_VALIDATE $(DIMENSIONS) -g -O2 -Wall -Wextra -o $@ \
+		mknative.c decoder.c
+
+mknormal: mknormal.c decoder.c decoder.h
+	$(CC) -DDECODER_VALIDATE $(DIMENSIONS) -g -O2 -Wall -Wextra -o $@ \
+		mknormal.c decoder.c
+
+# The cost estimate decodes the same format the harness does, so it takes the
+# same definitions. It has to count what the decoder does, though, and it keeps
+# its own framebuffer.
+CDEFS_COST = $(filter-out -DDECODER_ARENA,$(CDEFS)) -DDECODER_STATS
+video-demo-cost: cost.c decoder.c decoder.h
+	$(CC) $(CDEFS_COST) -g -O2 -Wall -Wextra -o $@ cost.c decoder.c -lm
+
+%-novalidate.o: %.c
+	$(CC) $(CFLAGS_NOVALIDATE) -c -o $@ $^
+
 %.o: %.c
 	$(CC) $(CFLAGS) -c -o $@ $^
@@ -2,18 +2,54 @@
  * \file video.h
  * \brief Cinepak video data
  *
- * The corresponding `video.c` file is generated automatically by the
- * `Makefile`. We expect the C file to have the actual data as well as the
- * length of the data. We also expect it to have a specific name.
+ * The data comes from `video.s`, which includes the CVID file the `Makefile`
+ * copies to `video.cvid` as-is. It goes in read-only data, aligned to a word.
+ *
+ * The `Makefile` also generates an index of the video's frames with `mkindex`,
+ * in `video-index.c`. This way, the player can find frames without walking the
+ * stream from the start. It also says how many strips the video uses, so the
+ * decoder only needs codebooks for that many.
  */
 
 #pragma once
 
+#include "decoder.h"
+
 /**
  * \brief Raw CVID data
  */
-extern unsigned char video_cvid[];
+extern const unsigned char video_cvid[];
 /**
  * \brief Length of `video_cvid` in bytes
  */
-extern unsigned int video_cvid_len;
+extern const unsigned int video_cvid_len;
+
+/**
+ * \brief Information about every frame in `video_cvid`, in order
+ */
+extern const decoder_frame_info_t video_index[];
+/**
+ * \brief Number of frames in `video_index`
+ */
+extern const unsigned int video_index_len;
+
+/**
+ * \brief Frame numbers of every keyframe, in increasing order
+ *
+ * These index into `video_index`.
+ */
+extern const unsigned int video_keyframes[];
+/**
+ * \brief Number of keyframes in `video_keyframes`
+ */
+extern const unsigned int video_keyframes_len;
+
+/**
+ * \brief The most strips any frame in `video_cvid` has
+ */
+extern const unsigned int video_max_strips;
+/**
+ * \brief Storage for the decoder's codebooks, sized for `video_max_strips`
+ * \see decoder_set_arena()
+ */
+extern decoder_pair_t video_arena[];
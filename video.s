@@ -0,0 +1,21 @@
+    ; Cinepak video data
+    ;
+    ; This pulls the raw CVID file in as-is, so the assembler doesn't have to
+    ; parse an array with an element for every byte. It provides the symbols
+    ; declared in `video.h`. The index is in `video-index.c`, which is generated.
+    ;
+    ; The data gets its own section so `ldscript` can place it at the start of
+    ; read-only data. It's aligned to a word, so it can be read a word at a
+    ; time.
+
+    .section .rodata.video, "a"
+    .p2align 2
+    .global video_cvid
+video_cvid:
+    .incbin "video.cvid"
+video_cvid_end:
+
+    .p2align 2
+    .global video_cvid_len
+video_cvid_len:
+    .4byte video_cvid_end - video_cvid